@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "cache.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "source.h"
+
+const char* cacheDirectory = NULL;
+
+// A cache file is a header followed by the script's function, written
+// depth first: its fields, its chunk and then its constants, which may be
+// more functions. Strings, functions and jump tables get an index in the
+// order they are written, and later uses refer back to it, so each string
+// is stored once and a function an inlining guard compares against is
+// still the same object after loading. A linked image is the same, with
+// the path and function of each file the script loads after the script.
+//
+// Everything is in the byte order of the machine that wrote it. A file from
+// another machine fails the magic check and is compiled over.
+
+// Bump this whenever the bytecode or the layout below changes
+#define CACHE_VERSION 6
+#define CACHE_MAGIC 0x4350504e
+#define IMAGE_MAGIC 0x4950504e
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t optimizationLevel;
+    uint32_t sourceLength;
+    uint64_t sourceHash;
+    uint64_t checksum;
+} CacheHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t moduleCount;
+    uint64_t checksum;
+} ImageHeader;
+
+typedef enum {
+    SAVED_VALUE,
+    SAVED_STRING,
+    SAVED_FUNCTION,
+    SAVED_JUMP_TABLE,
+    SAVED_OBJECT
+} SavedKind;
+
+// FNV-1a, 64 bits wide since it names the file
+uint64_t hashBytes(const void* bytes, size_t length) {
+    const uint8_t* data = (const uint8_t*)bytes;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void cachePath(char* path, size_t size, uint64_t hash) {
+    snprintf(path, size, "%s/%016llx-O%d.nppc", cacheDirectory, (unsigned long long)hash, optimizationLevel);
+}
+
+typedef struct {
+    const uint8_t* current;
+    const uint8_t* end;
+    Obj** objects;
+    int objectCount;
+    int objectCapacity;
+    bool failed;
+} Reader;
+
+static bool readBytes(Reader* reader, void* data, size_t size) {
+    if (reader->failed || (size_t)(reader->end - reader->current) < size) {
+        reader->failed = true;
+        return false;
+    }
+
+    if (size > 0) memcpy(data, reader->current, size);
+    reader->current += size;
+    return true;
+}
+
+static int readInt(Reader* reader) {
+    int32_t value = 0;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+// A count of items of the given size, which must all still be in the file
+static int readCount(Reader* reader, size_t size) {
+    int count = readInt(reader);
+    if (count < 0 || (size_t)(reader->end - reader->current) / size < (size_t)count) {
+        reader->failed = true;
+        return 0;
+    }
+    return count;
+}
+
+static void addReadObject(Reader* reader, Obj* object) {
+    if (reader->objectCount == reader->objectCapacity) {
+        int oldCapacity = reader->objectCapacity;
+        reader->objectCapacity = GROW_CAPACITY(oldCapacity);
+        reader->objects = ARENA_GROW(Obj*, reader->objects, oldCapacity, reader->objectCapacity);
+    }
+    reader->objects[reader->objectCount++] = object;
+}
+
+static ObjFunction* readFunction(Reader* reader);
+static ObjJumpTable* readJumpTable(Reader* reader);
+
+static Value readValue(Reader* reader) {
+    uint8_t kind = SAVED_VALUE;
+    readBytes(reader, &kind, 1);
+
+    switch (kind) {
+        case SAVED_VALUE: {
+            Value value = NULL_VAL;
+            readBytes(reader, &value, sizeof(Value));
+            if (IS_OBJ(value)) reader->failed = true;
+            return reader->failed ? NULL_VAL : value;
+        }
+        case SAVED_STRING: {
+            int length = readCount(reader, 1);
+            if (reader->failed) return NULL_VAL;
+            ObjString* string = copyString((const char*)reader->current, length);
+            reader->current += length;
+            addReadObject(reader, (Obj*)string);
+            return OBJ_VAL(string);
+        }
+        case SAVED_FUNCTION: {
+            ObjFunction* function = readFunction(reader);
+            return reader->failed ? NULL_VAL : OBJ_VAL(function);
+        }
+        case SAVED_JUMP_TABLE: {
+            ObjJumpTable* table = readJumpTable(reader);
+            return reader->failed ? NULL_VAL : OBJ_VAL(table);
+        }
+        case SAVED_OBJECT: {
+            int index = readInt(reader);
+            if (reader->failed || index < 0 || index >= reader->objectCount) {
+                reader->failed = true;
+                return NULL_VAL;
+            }
+            return OBJ_VAL(reader->objects[index]);
+        }
+        default:
+            reader->failed = true;
+            return NULL_VAL;
+    }
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+    ObjFunction* function = newFunction();
+    addReadObject(reader, (Obj*)function);
+    function->arity = readInt(reader);
+    function->upvalueCount = readInt(reader);
+    function->shareClosure = readInt(reader) != 0;
+    Value name = readValue(reader);
+    if (IS_STRING(name)) {
+        function->name = AS_STRING(name);
+    } else if (!IS_NULL(name)) {
+        reader->failed = true;
+    }
+
+    Chunk* chunk = &function->chunk;
+    int count = readCount(reader, sizeof(uint8_t));
+    chunk->code = ALLOCATE(uint8_t, count);
+    chunk->capacity = count;
+    if (readBytes(reader, chunk->code, count)) chunk->count = count;
+
+    int lineCount = readCount(reader, sizeof(LineStart));
+    chunk->lines = ALLOCATE(LineStart, lineCount);
+    chunk->lineCapacity = lineCount;
+    if (readBytes(reader, chunk->lines, sizeof(LineStart) * lineCount)) chunk->lineCount = lineCount;
+
+    // Each constant takes at least a byte
+    int constantCount = readCount(reader, 1);
+    chunk->constants.values = ALLOCATE(Value, constantCount);
+    chunk->constants.capacity = constantCount;
+    for (int i = 0; i < constantCount && !reader->failed; i++) {
+        chunk->constants.values[i] = readValue(reader);
+        chunk->constants.count++;
+    }
+
+    int handlerCount = readCount(reader, sizeof(Handler));
+    chunk->handlers = ALLOCATE(Handler, handlerCount);
+    chunk->handlerCapacity = handlerCount;
+    if (readBytes(reader, chunk->handlers, sizeof(Handler) * handlerCount)) chunk->handlerCount = handlerCount;
+    return function;
+}
+
+static ObjJumpTable* readJumpTable(Reader* reader) {
+    int count = readCount(reader, sizeof(int));
+    uint8_t hashed = 0;
+    readBytes(reader, &hashed, 1);
+    ObjJumpTable* table = newJumpTable(count, hashed);
+    addReadObject(reader, (Obj*)table);
+
+    readBytes(reader, &table->low, sizeof(double));
+    if (!hashed) {
+        readBytes(reader, table->targets, sizeof(int) * (count + 1));
+        return table;
+    }
+
+    // Keys are hashed by what they are in memory, and the strings are new,
+    // so the slots are worked out again rather than copied
+    Value* keys = ARENA_ALLOCATE(Value, count);
+    for (int i = 0; i < count && !reader->failed; i++) {
+        keys[i] = readValue(reader);
+    }
+    int* targets = ARENA_ALLOCATE(int, count + 1);
+    if (!readBytes(reader, targets, sizeof(int) * (count + 1)) || (count & (count - 1)) != 0) {
+        reader->failed = true;
+        return table;
+    }
+
+    for (int i = 0; i <= count; i++) {
+        table->targets[i] = targets[count];
+    }
+    for (int i = 0; i < count; i++) {
+        if (keys[i] == NULL_VAL) continue;
+        uint32_t index = hashValue(keys[i]) & (count - 1);
+        while (table->keys[index] != NULL_VAL) {
+            index = (index + 1) & (count - 1);
+        }
+        table->keys[index] = keys[i];
+        table->targets[index] = targets[i];
+    }
+    return table;
+}
+
+static void initReader(Reader* reader, Source* file) {
+    reader->current = (const uint8_t*)file->chars;
+    reader->end = reader->current + file->length;
+    reader->objects = NULL;
+    reader->objectCount = 0;
+    reader->objectCapacity = 0;
+    reader->failed = false;
+}
+
+static ObjFunction* readScript(Reader* reader) {
+    Value value = readValue(reader);
+    return !reader->failed && IS_FUNCTION(value) ? AS_FUNCTION(value) : NULL;
+}
+
+// The function compiled from this source by an earlier run, or NULL if
+// there is none or it can't be used
+ObjFunction* loadCache(const char* source, int length) {
+    uint64_t hash = hashBytes(source, length);
+    char path[4096];
+    cachePath(path, sizeof(path), hash);
+
+    Source file;
+    if (!openSource(&file, path, false)) return NULL;
+
+    CacheHeader header;
+    Reader reader;
+    initReader(&reader, &file);
+
+    ObjFunction* function = NULL;
+    ArenaMark mark = markArena();
+    if (readBytes(&reader, &header, sizeof(header)) &&
+        header.magic == CACHE_MAGIC && header.version == CACHE_VERSION &&
+        header.optimizationLevel == (uint32_t)optimizationLevel &&
+        header.sourceLength == (uint32_t)length && header.sourceHash == hash &&
+        header.checksum == hashBytes(reader.current, reader.end - reader.current)) {
+        function = readScript(&reader);
+        if (reader.current != reader.end) function = NULL;
+    }
+    releaseArena(mark);
+
+    closeSource(&file);
+    return function;
+}
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    // Open addressing, from each object written so far to its index
+    Obj** objects;
+    int* indexes;
+    int objectCount;
+    int objectCapacity;
+    bool failed;
+} Writer;
+
+static void writeBytes(Writer* writer, const void* data, size_t size) {
+    if (size == 0) return;
+    if (writer->count + size > writer->capacity) {
+        size_t oldCapacity = writer->capacity;
+        while (writer->count + size > writer->capacity) writer->capacity = GROW_CAPACITY(writer->capacity);
+        writer->bytes = ARENA_GROW(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+    }
+
+    memcpy(writer->bytes + writer->count, data, size);
+    writer->count += size;
+}
+
+static void writeByte(Writer* writer, uint8_t byte) {
+    writeBytes(writer, &byte, 1);
+}
+
+static void writeInt(Writer* writer, int value) {
+    int32_t stored = value;
+    writeBytes(writer, &stored, sizeof(stored));
+}
+
+static uint32_t hashPointer(Obj* object) {
+    return (uint32_t)(((uintptr_t)object >> 4) * 2654435761u);
+}
+
+static int findWrittenSlot(Obj** objects, int capacity, Obj* object) {
+    uint32_t index = hashPointer(object) & (capacity - 1);
+    while (objects[index] != NULL && objects[index] != object) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return index;
+}
+
+// The index of an object already written, or -1 after giving it the next one
+static int addWrittenObject(Writer* writer, Obj* object) {
+    if (writer->objectCapacity > 0) {
+        int slot = findWrittenSlot(writer->objects, writer->objectCapacity, object);
+        if (writer->objects[slot] != NULL) return writer->indexes[slot];
+    }
+
+    if ((writer->objectCount + 1) * 2 > writer->objectCapacity) {
+        int capacity = writer->objectCapacity < 64 ? 64 : writer->objectCapacity * 2;
+        Obj** objects = ARENA_ALLOCATE(Obj*, capacity);
+        int* indexes = ARENA_ALLOCATE(int, capacity);
+        memset(objects, 0, sizeof(Obj*) * capacity);
+        for (int i = 0; i < writer->objectCapacity; i++) {
+            if (writer->objects[i] == NULL) continue;
+            int slot = findWrittenSlot(objects, capacity, writer->objects[i]);
+            objects[slot] = writer->objects[i];
+            indexes[slot] = writer->indexes[i];
+        }
+        writer->objects = objects;
+        writer->indexes = indexes;
+        writer->objectCapacity = capacity;
+    }
+
+    int slot = findWrittenSlot(writer->objects, writer->objectCapacity, object);
+    writer->objects[slot] = object;
+    writer->indexes[slot] = writer->objectCount++;
+    return -1;
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function);
+static void writeJumpTable(Writer* writer, ObjJumpTable* table);
+
+static void writeValue(Writer* writer, Value value) {
+    if (!IS_OBJ(value)) {
+        writeByte(writer, SAVED_VALUE);
+        writeBytes(writer, &value, sizeof(Value));
+        return;
+    }
+
+    // Nothing else is ever a constant
+    Obj* object = AS_OBJ(value);
+    if (object->type != OBJ_STRING && object->type != OBJ_FUNCTION && object->type != OBJ_JUMP_TABLE) {
+        writer->failed = true;
+        return;
+    }
+
+    int index = addWrittenObject(writer, object);
+    if (index >= 0) {
+        writeByte(writer, SAVED_OBJECT);
+        writeInt(writer, index);
+    } else if (object->type == OBJ_STRING) {
+        ObjString* string = (ObjString*)object;
+        writeByte(writer, SAVED_STRING);
+        writeInt(writer, string->length);
+        writeBytes(writer, string->chars, string->length);
+    } else if (object->type == OBJ_FUNCTION) {
+        writeByte(writer, SAVED_FUNCTION);
+        writeFunction(writer, (ObjFunction*)object);
+    } else {
+        writeByte(writer, SAVED_JUMP_TABLE);
+        writeJumpTable(writer, (ObjJumpTable*)object);
+    }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+    // A body --lazy left for later has no bytecode to save yet
+    if (function->lazy != NULL) {
+        writer->failed = true;
+        return;
+    }
+
+    writeInt(writer, function->arity);
+    writeInt(writer, function->upvalueCount);
+    writeInt(writer, function->shareClosure);
+    writeValue(writer, function->name != NULL ? OBJ_VAL(function->name) : NULL_VAL);
+
+    Chunk* chunk = &function->chunk;
+    writeInt(writer, chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+    writeInt(writer, chunk->lineCount);
+    writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+    writeInt(writer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeValue(writer, chunk->constants.values[i]);
+    }
+    writeInt(writer, chunk->handlerCount);
+    writeBytes(writer, chunk->handlers, sizeof(Handler) * chunk->handlerCount);
+}
+
+static void writeJumpTable(Writer* writer, ObjJumpTable* table) {
+    writeInt(writer, table->count);
+    writeByte(writer, table->keys != NULL);
+    writeBytes(writer, &table->low, sizeof(double));
+    if (table->keys != NULL) {
+        for (int i = 0; i < table->count; i++) {
+            writeValue(writer, table->keys[i]);
+        }
+    }
+    writeBytes(writer, table->targets, sizeof(int) * (table->count + 1));
+}
+
+// Written to a file of its own and then renamed over the old one, so runs
+// side by side never see half a file
+static bool writeFile(const char* path, Writer* writer) {
+    char temporary[4200];
+    snprintf(temporary, sizeof(temporary), "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
+
+    FILE* file = fopen(temporary, "wb");
+    if (file == NULL) return false;
+    bool written = fwrite(writer->bytes, 1, writer->count, file) == writer->count;
+    if (fclose(file) != 0) written = false;
+
+    if (!written || !MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING)) {
+        remove(temporary);
+        return false;
+    }
+    return true;
+}
+
+static void initWriter(Writer* writer) {
+    writer->bytes = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+    writer->objects = NULL;
+    writer->indexes = NULL;
+    writer->objectCount = 0;
+    writer->objectCapacity = 0;
+    writer->failed = false;
+}
+
+// Saving is best effort: if the directory can't be written to, the script
+// is simply compiled again next time
+void saveCache(const char* source, int length, ObjFunction* function) {
+    Writer writer;
+    initWriter(&writer);
+
+    ArenaMark mark = markArena();
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    writeBytes(&writer, &header, sizeof(header));
+    writeValue(&writer, OBJ_VAL(function));
+
+    if (!writer.failed) {
+        header.magic = CACHE_MAGIC;
+        header.version = CACHE_VERSION;
+        header.optimizationLevel = optimizationLevel;
+        header.sourceLength = length;
+        header.sourceHash = hashBytes(source, length);
+        header.checksum = hashBytes(writer.bytes + sizeof(header), writer.count - sizeof(header));
+        memcpy(writer.bytes, &header, sizeof(header));
+
+        char path[4096];
+        cachePath(path, sizeof(path), header.sourceHash);
+        CreateDirectoryA(cacheDirectory, NULL);
+        writeFile(path, &writer);
+    }
+    releaseArena(mark);
+}
+
+// The files a linked image carries, which get() runs instead of reading
+// them from disk
+static ObjString** linkedPaths = NULL;
+static ObjFunction** linkedFunctions = NULL;
+static int linkedCount = 0;
+
+bool writeImage(const char* path, ObjFunction* script, const char** paths, ObjFunction** functions, int count) {
+    Writer writer;
+    initWriter(&writer);
+
+    ArenaMark mark = markArena();
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    writeBytes(&writer, &header, sizeof(header));
+    writeValue(&writer, OBJ_VAL(script));
+    for (int i = 0; i < count; i++) {
+        writeValue(&writer, OBJ_VAL(copyString(paths[i], (int)strlen(paths[i]))));
+        writeValue(&writer, OBJ_VAL(functions[i]));
+    }
+
+    bool written = false;
+    if (!writer.failed) {
+        header.magic = IMAGE_MAGIC;
+        header.version = CACHE_VERSION;
+        header.moduleCount = count;
+        header.checksum = hashBytes(writer.bytes + sizeof(header), writer.count - sizeof(header));
+        memcpy(writer.bytes, &header, sizeof(header));
+        written = writeFile(path, &writer);
+    }
+    releaseArena(mark);
+    return written;
+}
+
+// Reads the whole image in one go and returns the script, keeping the files
+// it carries for get()
+ObjFunction* loadImage(const char* path) {
+    Source file;
+    if (!openSource(&file, path, false)) return NULL;
+
+    ImageHeader header;
+    Reader reader;
+    initReader(&reader, &file);
+
+    ObjFunction* script = NULL;
+    ArenaMark mark = markArena();
+    if (readBytes(&reader, &header, sizeof(header)) &&
+        header.magic == IMAGE_MAGIC && header.version == CACHE_VERSION &&
+        header.checksum == hashBytes(reader.current, reader.end - reader.current)) {
+        script = readScript(&reader);
+        int count = (int)header.moduleCount;
+        linkedPaths = ALLOCATE(ObjString*, count);
+        linkedFunctions = ALLOCATE(ObjFunction*, count);
+        for (linkedCount = 0; linkedCount < count && !reader.failed; linkedCount++) {
+            Value name = readValue(&reader);
+            if (!IS_STRING(name)) reader.failed = true;
+            linkedPaths[linkedCount] = reader.failed ? NULL : AS_STRING(name);
+            linkedFunctions[linkedCount] = readScript(&reader);
+        }
+        if (reader.failed || reader.current != reader.end) script = NULL;
+    }
+    releaseArena(mark);
+
+    closeSource(&file);
+    return script;
+}
+
+ObjFunction* findLinkedModule(const char* path) {
+    for (int i = 0; i < linkedCount; i++) {
+        if (linkedPaths[i] != NULL && strcmp(linkedPaths[i]->chars, path) == 0) return linkedFunctions[i];
+    }
+    return NULL;
+}
+
+void markLinkedModules() {
+    for (int i = 0; i < linkedCount; i++) {
+        markObject((Obj*)linkedPaths[i]);
+        markObject((Obj*)linkedFunctions[i]);
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef npp_cache_h
+#define npp_cache_h
+
+#include "object.h"
+
+// Where compiled scripts are kept between runs, or NULL to always compile
+extern const char* cacheDirectory;
+
+uint64_t hashBytes(const void* bytes, size_t length);
+ObjFunction* loadCache(const char* source, int length);
+void saveCache(const char* source, int length, ObjFunction* function);
+bool writeImage(const char* path, ObjFunction* script, const char** paths, ObjFunction** functions, int count);
+ObjFunction* loadImage(const char* path);
+ObjFunction* findLinkedModule(const char* path);
+void markLinkedModules();
+
+#endif
\ No newline at end of file
@@ -9,14 +9,20 @@ void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->handlerCount = 0;
+    chunk->handlerCapacity = 0;
+    chunk->handlers = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(Handler, chunk->handlers, chunk->handlerCapacity);
     initChunk(chunk);
 }
 
@@ -25,17 +31,87 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+    }
+
+    // Runs past the end are left from code the compiler took back
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= chunk->count) {
+        chunk->lineCount--;
+    }
+
+    if (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != line) {
+        if (chunk->lineCapacity < chunk->lineCount + 1) {
+            int oldCapacity = chunk->lineCapacity;
+            chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+            chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+        }
+
+        LineStart* start = &chunk->lines[chunk->lineCount++];
+        start->offset = chunk->count;
+        start->line = line;
+        start->inlined = -1;
+        start->inlinedLine = 0;
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
+// Gives the finished chunk's spare capacity back
+void shrinkChunk(Chunk* chunk) {
+    chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, chunk->count);
+    chunk->capacity = chunk->count;
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines, chunk->lineCapacity, chunk->lineCount);
+    chunk->lineCapacity = chunk->lineCount;
+    chunk->constants.values = GROW_ARRAY(Value, chunk->constants.values, chunk->constants.capacity, chunk->constants.count);
+    chunk->constants.capacity = chunk->constants.count;
+    chunk->handlers = GROW_ARRAY(Handler, chunk->handlers, chunk->handlerCapacity, chunk->handlerCount);
+    chunk->handlerCapacity = chunk->handlerCount;
+}
+
+// The last run starting at or before offset
+// The run the byte at offset belongs to, or NULL for an empty chunk
+LineStart* findLine(Chunk* chunk, int offset) {
+    if (chunk->lineCount == 0) return NULL;
+
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return &chunk->lines[low];
+}
+
+int getLine(Chunk* chunk, int offset) {
+    LineStart* start = findLine(chunk, offset);
+    return start == NULL ? 0 : start->line;
+}
+
 int addConstant(Chunk* chunk, Value value) {
+    lockHeap();
     push(value);
     writeValueArray(&chunk->constants, value);
     pop();
+    unlockHeap();
     return chunk->constants.count - 1;
+}
+
+// Handlers are added when their try block ends, so inner blocks always come
+// before the blocks that enclose them.
+void addHandler(Chunk* chunk, int start, int end, int target, int stackDepth) {
+    if (chunk->handlerCapacity < chunk->handlerCount + 1) {
+        int oldCapacity = chunk->handlerCapacity;
+        chunk->handlerCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->handlers = GROW_ARRAY(Handler, chunk->handlers, oldCapacity, chunk->handlerCapacity);
+    }
+
+    Handler* handler = &chunk->handlers[chunk->handlerCount++];
+    handler->start = start;
+    handler->end = end;
+    handler->target = target;
+    handler->stackDepth = stackDepth;
 }
\ No newline at end of file
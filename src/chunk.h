@@ -8,6 +8,7 @@ typedef enum {
     OP_CONSTANT,
     OP_BOOL,
     OP_POP,
+    OP_DUP,
     OP_LOCAL,
     OP_GLOBAL,
     OP_DEFINE_GLOBAL,
@@ -16,10 +17,27 @@ typedef enum {
     OP_SET_PROPERTY,
     OP_GET_SUPER,
     OP_COMPARE,
+    OP_COMPARE_NOT,
     OP_BINARY,
     OP_UNARY,
+    OP_MODULO,
+    OP_FLOOR_DIVIDE,
+    OP_POWER,
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
+    OP_BUILD_STRING,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
+    OP_POP_JUMP_IF_FALSE,
+    OP_LOOP,
+    OP_JUMP_TABLE,
+    OP_JUMP_HASH,
+    OP_FOR_LOOP,
+    OP_FOR_STEP,
     OP_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
@@ -28,20 +46,83 @@ typedef enum {
     OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    OP_THROW,
+    OP_INLINE_GUARD,
+    OP_INLINE_INVOKE_GUARD,
+    OP_INLINE_EXIT,
+    OP_NATIVE_GUARD,
+    OP_SCALAR_NEW,
+    OP_SCALAR_GET,
+    OP_SCALAR_SET,
+    OP_ADD_LOCAL_CONST,
+    OP_ADD_UPVALUE_CONST,
+    OP_COMPOUND_LOCAL,
+    OP_COMPOUND_UPVALUE,
+    OP_COMPOUND_GLOBAL,
+    OP_COMPOUND_PROPERTY
 } OpCode;
 
+// Set in the opcode of the long form of an instruction, where constant
+// indexes take three bytes instead of one and jump distances three instead
+// of two. The compiler only uses it when the short form doesn't fit.
+#define OP_LONG 0x80
+#define OP_CONSTANT_LONG (OP_CONSTANT | OP_LONG)
+
+// The second operand of OP_LOCAL, OP_GLOBAL and OP_UPVALUE is 0 for a get
+// and 1 for a set. The optimizer turns a set followed by a pop into one
+// instruction with SET_AND_POP. The last operand of the OP_ADD_ and
+// OP_COMPOUND_ instructions works the same way, but is never 0, and is
+// POSTFIX for x++ and x--, which leave the old value instead of the new one.
+#define SET_AND_POP 2
+#define POSTFIX 3
+
+// Flags for the mode operand of OP_FOR_LOOP and OP_FOR_STEP
+#define FOR_CONSTANT_LIMIT 1
+#define FOR_INCLUSIVE 2
+
+// A try block covers the bytecode in [start, end). When an error is thrown
+// from inside it, the stack is cut back to stackDepth slots and execution
+// continues at target with the error value pushed.
+typedef struct {
+    int start;
+    int end;
+    int target;
+    int stackDepth;
+} Handler;
+
+// Lines are stored once per run of bytes from the same line. Each run
+// starts at offset and lasts until the next one. Bytes copied from the body
+// of an inlined function keep the line of the call they replaced, and also
+// name that function by its constant in inlined, with the line the bytes
+// came from in inlinedLine. Everywhere else inlined is -1.
+typedef struct {
+    int offset;
+    int line;
+    int inlined;
+    int inlinedLine;
+} LineStart;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
     ValueArray constants;
+    int handlerCount;
+    int handlerCapacity;
+    Handler* handlers;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void shrinkChunk(Chunk* chunk);
+LineStart* findLine(Chunk* chunk, int offset);
+int getLine(Chunk* chunk, int offset);
 int addConstant(Chunk* chunk, Value value);
+void addHandler(Chunk* chunk, int start, int end, int target, int stackDepth);
 
 #endif
\ No newline at end of file
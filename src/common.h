@@ -9,6 +9,15 @@
 #include <stdlib.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT24_MAX 0xffffff
+
+// Compiler state is kept per thread, so files and function bodies can be
+// compiled side by side
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
 
 extern bool debug;
 
@@ -23,32 +32,4 @@ static inline bool hasSuffix(const char *str, const char *suffix) {
     return strcmp(str + fileLen - suffixLen, suffix) == 0;
 }
 
-static inline char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
-    }
-
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
-    }
-
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
-    }
-
-    buffer[bytesRead] = '\0';
-    fclose(file);
-    return buffer;
-}
-
 #endif
\ No newline at end of file
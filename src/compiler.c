@@ -1,19 +1,41 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <windows.h>
 
 #include "common.h"
+#include "cache.h"
 #include "compiler.h"
 #include "memory.h"
 #include "scanner.h"
 #include "debug.h"
+#include "optimizer.h"
+#include "source.h"
+
+// What happens to a function body that needs no upvalues: compiled where it
+// is, left for its first call (--lazy), or left for the threads of --jobs
+typedef enum {
+    BODIES_WHOLE,
+    BODIES_LAZY,
+    BODIES_PENDING
+} BodyMode;
 
 typedef struct {
+    Scanner scanner;
     Token current;
     Token previous;
     bool hadError;
     bool panikMode;
+    int leftStart;
+    const char* source;
+    int sourceLength;
+    int shadowedNatives;
+    BodyMode bodies;
+    bool quiet;
+    bool stream;
+    bool inConstant;
 } Parser;
 
 typedef enum {
@@ -23,9 +45,14 @@ typedef enum {
     PREC_AND,
     PREC_EQUALITY,
     PREC_COMPARISON,
+    PREC_BIT_OR,
+    PREC_BIT_XOR,
+    PREC_BIT_AND,
+    PREC_SHIFT,
     PREC_TERM,
     PREC_FACTOR,
     PREC_UNARY,
+    PREC_POWER,
     PREC_CALL,
     PREC_PRIMARY
 } Precedence;
@@ -38,10 +65,30 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+#define SCALAR_MAX_FIELDS 8
+
+// A class whose initializer only copies parameters and constants into
+// fields. Instances that never leave the function that makes them can keep
+// those fields in local slots instead.
+typedef struct {
+    ObjString* name;
+    ObjFunction* initializer;
+    int fieldCount;
+    ObjString* fields[SCALAR_MAX_FIELDS];
+    uint8_t parameters[SCALAR_MAX_FIELDS];
+    Value constants[SCALAR_MAX_FIELDS];
+} ScalarClass;
+
 typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    bool hasConstant;
+    Value constant;
+    uint8_t constantOp;
+    uint8_t constantIndex;
+    ScalarClass* scalar;
+    int argCount;
 } Local;
 
 typedef struct {
@@ -56,6 +103,14 @@ typedef enum {
     TYPE_SCRIPT
 } FunctionType;
 
+// Maps each constant already in the chunk to its index, so names,
+// operators and numbers used many times take one slot. Strings are
+// interned, so equal values have equal bits.
+typedef struct {
+    Value value;
+    int index;
+} ConstantEntry;
+
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
@@ -64,16 +119,89 @@ typedef struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int* longJumps;
+    int longJumpCount;
+    int longJumpCapacity;
+    ConstantEntry* constants;
+    int constantCount;
+    int constantCapacity;
 } Compiler;
 
 typedef struct ClassCompiler {
     struct ClassCompiler* enclosing;
     bool hasSuperclass;
+    ObjFunction* initializer;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler* current = NULL;
+THREAD_LOCAL ClassCompiler* currentClass = NULL;
+
+static THREAD_LOCAL ScalarClass* scalarClasses = NULL;
+static THREAD_LOCAL int scalarClassCount = 0;
+static THREAD_LOCAL int scalarClassCapacity = 0;
+
+// A name declared with const. Reads compile to the value itself, so it
+// never takes a slot or a global. localCount is how many locals its
+// compiler had at the time, since only those are older than it.
+typedef struct {
+    Token name;
+    Value value;
+    Compiler* compiler;
+    int depth;
+    int localCount;
+} NamedConstant;
+
+static THREAD_LOCAL NamedConstant* namedConstants = NULL;
+static THREAD_LOCAL int namedConstantCount = 0;
+static THREAD_LOCAL int namedConstantCapacity = 0;
+
+// With --lazy, a function body that needs nothing from the functions
+// around it is only checked for balanced braces, then compiled on its
+// first call. With --jobs, it is compiled on another thread instead. The
+// source it points into is copied, since the buffer main() or get() read
+// it from may be gone by then, and shared by every body in the file.
+typedef struct {
+    char* chars;
+    int length;
+    int refs;
+    int shadowedNatives;
+} LazySource;
+
+// The consts are the ones visible where the body was declared
+struct LazyBody {
+    LazySource* source;
+    int offset;
+    int line;
+    FunctionType type;
+    NamedConstant* constants;
+    int constantCount;
+};
+
+bool lazyCompile = false;
+
+// A stream is compiled one top-level declaration at a time, so no piece can
+// see what the later ones do. streamCompile marks the next compile() as a
+// piece starting on streamLine. Its top-level consts are kept in
+// streamConstants for the pieces after it.
+bool streamCompile = false;
+int streamLine = 1;
+static NamedConstant* streamConstants = NULL;
+static int streamConstantCount = 0;
+static int streamConstantCapacity = 0;
+static THREAD_LOCAL LazySource* lazySource = NULL;
+
+// Only the main thread touches these
+int compileJobs = 1;
+static ObjFunction** pendingBodies = NULL;
+static int pendingCount = 0;
+static int pendingCapacity = 0;
+
+static double compileSeconds = 0;
+static double lazySeconds = 0;
+static int deferredCount = 0;
+static int lazyCount = 0;
+static int cachedCount = 0;
 
 static Chunk* currentChunk() {
     return &current->function->chunk;
@@ -83,6 +211,11 @@ static Chunk* currentChunk() {
 static void errorAt(Token* token, const char* message) {
     if (parser.panikMode) return;
     parser.panikMode = true;
+    parser.hadError = true;
+
+    // Threads compiling ahead stay quiet. If anything fails, the file is
+    // compiled again on its own, so errors come out in order.
+    if (parser.quiet) return;
 
     printf("\033[0;31m");
     printf("Compiler Error:\n");
@@ -101,7 +234,6 @@ static void errorAt(Token* token, const char* message) {
 
     fprintf(stderr, ": %s\n", message);
     printf("\033[0m");
-    parser.hadError = true;
 }
 
 static void error(const char* message) {
@@ -116,7 +248,7 @@ static void advance() {
     parser.previous = parser.current;
 
     for (;;) {
-        parser.current = scanToken();
+        parser.current = scanToken(&parser.scanner);
         if (parser.current.type != TOKEN_ERROR) break;
 
         errorAtCurrent(parser.current.start);
@@ -151,16 +283,35 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
-static void emitLoop(int loopStart) {
-    emitByte(OP_JUMP);
+// Jumps too far for two bytes are left at zero and remembered, together
+// with where they go, so endCompiler can switch them to their long form
+static void addLongJump(int offset, int target) {
+    if (current->longJumpCapacity < current->longJumpCount + 2) {
+        int oldCapacity = current->longJumpCapacity;
+        current->longJumpCapacity = GROW_CAPACITY(oldCapacity);
+        current->longJumps = ARENA_GROW(int, current->longJumps, oldCapacity, current->longJumpCapacity);
+    }
 
-    int offset = loopStart - (currentChunk()->count + 2);
-    if (offset < -32768 || offset > 32767) error("Loop body too large.");
+    current->longJumps[current->longJumpCount++] = offset;
+    current->longJumps[current->longJumpCount++] = target;
+}
+
+static void emitLoopOffset(int loopStart) {
+    int offset = currentChunk()->count - loopStart + 2;
+    if (offset > UINT16_MAX) {
+        addLongJump(currentChunk()->count, loopStart);
+        offset = 0;
+    }
 
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
 }
 
+static void emitLoop(int loopStart) {
+    emitByte(OP_LOOP);
+    emitLoopOffset(loopStart);
+}
+
 static int emitJump(uint8_t instruction) {
     emitByte(instruction);
     emitByte(0xff);
@@ -168,28 +319,81 @@ static int emitJump(uint8_t instruction) {
     return currentChunk()->count - 2;
 }
 
-static uint8_t makeConstant(Value value) {
+static ConstantEntry* findConstant(ConstantEntry* entries, int capacity, Value value) {
+    uint32_t index = hashValue(value) & (capacity - 1);
+    for (;;) {
+        ConstantEntry* entry = &entries[index];
+        if (entry->index == -1 || entry->value == value) return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growConstants() {
+    int capacity = GROW_CAPACITY(current->constantCapacity);
+    ConstantEntry* entries = ARENA_ALLOCATE(ConstantEntry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].index = -1;
+    }
+
+    for (int i = 0; i < current->constantCapacity; i++) {
+        ConstantEntry* entry = &current->constants[i];
+        if (entry->index != -1) *findConstant(entries, capacity, entry->value) = *entry;
+    }
+
+    current->constants = entries;
+    current->constantCapacity = capacity;
+}
+
+static int makeConstant(Value value) {
+    ConstantEntry* entry = NULL;
+    if (current->constantCapacity > 0) {
+        entry = findConstant(current->constants, current->constantCapacity, value);
+        if (entry->index != -1) return entry->index;
+    }
+
+    // Added first, so a collection while the table grows can't free value
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (current->constantCount + 1 > current->constantCapacity * 3 / 4) {
+        growConstants();
+        entry = findConstant(current->constants, current->constantCapacity, value);
+    }
+    entry->value = value;
+    entry->index = constant;
+    current->constantCount++;
+    if (constant > UINT24_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static void emitIndex(int index, bool isLong) {
+    if (isLong) {
+        emitByte((index >> 16) & 0xff);
+        emitByte((index >> 8) & 0xff);
+    }
+    emitByte(index & 0xff);
+}
+
+// Emits an instruction whose first operand is a constant index, using the
+// long form only when the index doesn't fit in a byte
+static void emitConstantOp(uint8_t op, int constant) {
+    bool isLong = constant > UINT8_MAX;
+    emitByte(isLong ? op | OP_LONG : op);
+    emitIndex(constant, isLong);
+}
+
 static void boolOp(const char* name) {
     Token new;
     new.length = 4;
     new.start = name;
 
-    uint8_t op = OP_BOOL;
-    int arg = identifierConstant(&new);
-    emitBytes(op, (uint8_t)arg);
+    emitConstantOp(OP_BOOL, identifierConstant(&new));
 }
 
 static void emitReturn() {
@@ -204,35 +408,323 @@ static void emitReturn() {
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitConstantOp(OP_CONSTANT, makeConstant(value));
+}
+
+static void emitValue(Value value) {
+    if (IS_BOOL(value)) {
+        boolOp(AS_BOOL(value) ? "TRUE" : "FALS");
+    } else if (IS_NULL(value)) {
+        boolOp("NULL");
+    } else {
+        emitConstant(value);
+    }
+}
+
+// Checks if the code from start to the end of the chunk is a single constant
+// load, and if so which value it loads
+static bool constantAt(int start, Value* value) {
+    Chunk* chunk = currentChunk();
+    if (chunk->count - start < 2) return false;
+
+    bool isLong = (chunk->code[start] & OP_LONG) != 0;
+    if (chunk->count - start != (isLong ? 4 : 2)) return false;
+
+    int index = chunk->code[start + 1];
+    if (isLong) index = (index << 16) | (chunk->code[start + 2] << 8) | chunk->code[start + 3];
+    Value constant = chunk->constants.values[index];
+    switch (chunk->code[start] & ~OP_LONG) {
+        case OP_CONSTANT:
+            *value = constant;
+            return true;
+        case OP_BOOL: {
+            const char* name = AS_CSTRING(constant);
+            if (strcmp(name, "TRUE") == 0) {
+                *value = BOOL_VAL(true);
+            } else if (strcmp(name, "FALS") == 0) {
+                *value = BOOL_VAL(false);
+            } else {
+                *value = NULL_VAL;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static bool isFalsey(Value value) {
+    return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static char bitwiseOperator(TokenType type) {
+    switch (type) {
+        case TOKEN_AMPERSAND:       return '&';
+        case TOKEN_PIPE:            return '|';
+        case TOKEN_CARET:           return '^';
+        case TOKEN_LESS_LESS:       return '<';
+        case TOKEN_GREATER_GREATER: return '>';
+        default:                    return '\0';
+    }
+}
+
+// Folding only happens when the result is exactly what the VM would compute,
+// anything that would be a runtime error is left for the VM to report
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+    switch (operatorType) {
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        default: break;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+        case TOKEN_PERCENT:       *result = NUMBER_VAL(numberModulo(x, y)); return true;
+        case TOKEN_TILDE_SLASH:   *result = NUMBER_VAL(numberFloorDivide(x, y)); return true;
+        case TOKEN_STAR_STAR:     *result = NUMBER_VAL(numberPower(x, y)); return true;
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+        default: break;
+    }
+
+    double bits;
+    char op = bitwiseOperator(operatorType);
+    if (op == '\0' || !numberBitwise(op, x, y, &bits)) return false;
+    *result = NUMBER_VAL(bits);
+    return true;
+}
+
+static bool identifiersEqual(Token* a, Token* b);
+
+static bool isCompound(TokenType type) {
+    return type >= TOKEN_PLUS_EQUAL && type <= TOKEN_MINUS_MINUS;
+}
+
+// x++ and x-- evaluate to the value x had before
+static uint8_t compoundStore(TokenType type) {
+    return type == TOKEN_PLUS_PLUS || type == TOKEN_MINUS_MINUS ? POSTFIX : 1;
+}
+
+// Looks ahead in the source for anything that could store into name, from
+// token up to the end of the block the scan starts in. The scanner is a copy,
+// so the compiler keeps its place.
+static bool storedAhead(Scanner scanner, Token* name, Token previous, Token token) {
+    bool stored = false;
+    int depth = 0;
+
+    while (token.type != TOKEN_EOF) {
+        if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE && depth-- == 0) {
+            break;
+        }
+
+        Token next = scanToken(&scanner);
+        if (token.type == TOKEN_IDENTIFIER && previous.type != TOKEN_DOT && identifiersEqual(&token, name)) {
+            if (next.type == TOKEN_EQUAL || isCompound(next.type) || previous.type == TOKEN_VAR || previous.type == TOKEN_FUN || previous.type == TOKEN_CLASS) {
+                stored = true;
+                break;
+            }
+        }
+
+        previous = token;
+        token = next;
+    }
+
+    return stored;
+}
+
+// Looks ahead the same way for a use of name other than a call, which
+// could let the value escape or be compared
+static bool onlyCalledAhead(Scanner scanner, Token* name, Token previous, Token token) {
+    int depth = 0;
+
+    while (token.type != TOKEN_EOF) {
+        if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE && depth-- == 0) {
+            break;
+        }
+
+        Token next = scanToken(&scanner);
+        if (token.type == TOKEN_IDENTIFIER && previous.type != TOKEN_DOT && identifiersEqual(&token, name) &&
+            next.type != TOKEN_LEFT_PAREN) {
+            return false;
+        }
+
+        previous = token;
+        token = next;
+    }
+
+    return true;
+}
+
+typedef struct {
+    const char* name;
+    int arity;
+    double (*unary)(double);
+    double (*binary)(double, double);
+} PureNative;
+
+// Natives that only do math on their arguments, so calls with constant
+// arguments can be worked out at compile time
+static PureNative pureNatives[] = {
+    {"sin",   1, sin,  NULL},
+    {"cos",   1, cos,  NULL},
+    {"tan",   1, tan,  NULL},
+    {"asin",  1, asin, NULL},
+    {"acos",  1, acos, NULL},
+    {"atan",  1, atan, NULL},
+    {"abs",   1, fabs, NULL},
+    {"sqrt",  1, sqrt, NULL},
+    {"hypot", 2, NULL, hypot},
+    {"powr",  2, NULL, pow},
+};
+
+#define PURE_NATIVE_COUNT (int)(sizeof(pureNatives) / sizeof(pureNatives[0]))
+
+// A script that defines or assigns a global with the same name as one of the
+// natives above gets no folding for that name. Scanned once, on first use.
+// A stream's later pieces can't be scanned, so it gets no folding at all.
+static bool nativeShadowed(int index) {
+    if (parser.stream) return true;
+    if (parser.shadowedNatives < 0) {
+        parser.shadowedNatives = 0;
+        for (int i = 0; i < PURE_NATIVE_COUNT; i++) {
+            Token name;
+            name.start = pureNatives[i].name;
+            name.length = (int)strlen(pureNatives[i].name);
+
+            Token start;
+            start.type = TOKEN_EOF;
+            Scanner scanner;
+            initScanner(&scanner, parser.source, parser.sourceLength);
+            Token first = scanToken(&scanner);
+            if (storedAhead(scanner, &name, start, first)) {
+                parser.shadowedNatives |= 1 << i;
+            }
+        }
+    }
+
+    return (parser.shadowedNatives & (1 << index)) != 0;
+}
+
+static bool foldNativeCall(int calleeStart, int argCount) {
+    Chunk* chunk = currentChunk();
+    int argsStart = calleeStart + 3;
+    if (argsStart + argCount * 2 != chunk->count) return false;
+    if (chunk->code[calleeStart] != OP_GLOBAL || chunk->code[calleeStart + 2] != 0) return false;
+
+    ObjString* name = AS_STRING(chunk->constants.values[chunk->code[calleeStart + 1]]);
+    int index = -1;
+    for (int i = 0; i < PURE_NATIVE_COUNT; i++) {
+        if (strcmp(name->chars, pureNatives[i].name) == 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index == -1 || pureNatives[index].arity != argCount) return false;
+
+    double args[2];
+    for (int i = 0; i < argCount; i++) {
+        int offset = argsStart + i * 2;
+        if (chunk->code[offset] != OP_CONSTANT) return false;
+
+        Value arg = chunk->constants.values[chunk->code[offset + 1]];
+        if (!IS_NUMBER(arg)) return false;
+        args[i] = AS_NUMBER(arg);
+    }
+
+    if (nativeShadowed(index)) return false;
+
+    PureNative* native = &pureNatives[index];
+    Value result = NUMBER_VAL(argCount == 1 ? native->unary(args[0]) : native->binary(args[0], args[1]));
+
+    // A const is worked out once, here, with the natives as they are
+    if (parser.inConstant) {
+        chunk->count = calleeStart;
+        emitConstant(result);
+        return true;
+    }
+
+    // Anywhere else, a file loaded with get(), or the file that loaded this
+    // one, could have put something else in the global by the time the call
+    // runs. The call is kept behind a guard that skips it while the global
+    // still holds the native.
+    int constant = makeConstant(result);
+    if (constant > UINT8_MAX) return false;
+
+    uint8_t callee[7];
+    int calleeLength = chunk->count - calleeStart;
+    memcpy(callee, &chunk->code[calleeStart], calleeLength);
+    chunk->count = calleeStart;
+
+    emitBytes(OP_NATIVE_GUARD, callee[1]);
+    emitByte((uint8_t)constant);
+    emitBytes(0, (uint8_t)(calleeLength + 2));
+    for (int i = 0; i < calleeLength; i++) {
+        emitByte(callee[i]);
+    }
+    emitBytes(OP_CALL, argCount);
+    return true;
 }
 
 static void patchJump(int offset) {
     int jump = currentChunk()->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        addLongJump(offset, currentChunk()->count);
+        jump = 0;
     }
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+static void initCompiler(Compiler* compiler, FunctionType type, ObjFunction* function) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
+    compiler->longJumps = NULL;
+    compiler->longJumpCount = 0;
+    compiler->longJumpCapacity = 0;
+    compiler->constants = NULL;
+    compiler->constantCount = 0;
+    compiler->constantCapacity = 0;
+    compiler->function = function != NULL ? function : newFunction();
     current = compiler;
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && function == NULL) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
 
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->hasConstant = false;
+    local->scalar = NULL;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -246,8 +738,24 @@ static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
 
+    int saved = 0;
+    if (!parser.hadError) {
+        if (current->longJumpCount > 0) widenJumps(function, current->longJumps, current->longJumpCount / 2);
+        saved = optimizeFunction(function);
+        shrinkChunk(&function->chunk);
+    }
+
     if (!parser.hadError && debug) {
         disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        if (optimizationLevel > 0) {
+            printf("\033[0;33m");
+            printf("-O%d saved %d bytes\n", optimizationLevel, saved);
+            printf("\033[0m");
+        }
+    }
+
+    while (namedConstantCount > 0 && namedConstants[namedConstantCount - 1].compiler == current) {
+        namedConstantCount--;
     }
 
     current = current->enclosing;
@@ -269,12 +777,20 @@ static void endScope() {
         }
         current->localCount--;
     }
+
+    while (namedConstantCount > 0 && namedConstants[namedConstantCount - 1].compiler == current &&
+           namedConstants[namedConstantCount - 1].depth > current->scopeDepth) {
+        namedConstantCount--;
+    }
 }
 
 static void expression();
 static void statement();
 static void declaration();
 static ParseRule* getRule(TokenType type);
+static void addScalarClass(Token* name, ObjFunction* initializer);
+static int scalarSlot(Local* local, int slot, ObjString* name);
+static bool isLocalName(Token* name);
 static void parsePrecedence(Precedence precedence);
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -296,6 +812,37 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
+// The innermost const called name, unless a local declared after it hides
+// it
+static NamedConstant* resolveNamedConstant(Token* name) {
+    for (int i = namedConstantCount - 1; i >= 0; i--) {
+        NamedConstant* constant = &namedConstants[i];
+        if (!identifiersEqual(name, &constant->name)) continue;
+
+        for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+            int newest = compiler == constant->compiler ? constant->localCount : 0;
+            for (int j = compiler->localCount - 1; j >= newest; j--) {
+                if (identifiersEqual(name, &compiler->locals[j].name)) return NULL;
+            }
+            if (compiler == constant->compiler) break;
+        }
+        return constant;
+    }
+
+    return NULL;
+}
+
+// Consts and variables in the same scope can't share a name
+static void checkNamedConstants(Token* name) {
+    for (int i = namedConstantCount - 1; i >= 0; i--) {
+        NamedConstant* constant = &namedConstants[i];
+        if (constant->compiler != current || constant->depth < current->scopeDepth) break;
+        if (identifiersEqual(name, &constant->name)) {
+            error("Already a constant with this name in this scope.");
+        }
+    }
+}
+
 static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -343,12 +890,15 @@ static void addLocal(Token name) {
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->hasConstant = false;
+    local->scalar = NULL;
 }
 
 static void declareVariable() {
+    Token* name = &parser.previous;
+    checkNamedConstants(name);
     if (current->scopeDepth == 0) return;
 
-    Token* name = &parser.previous;
     for (int i = current->localCount - 1; i >= 0; i--) {
         Local* local = &current->locals[i];
         if (local->depth != -1 && local->depth < current->scopeDepth) {
@@ -363,7 +913,7 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
@@ -377,13 +927,13 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitConstantOp(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -402,6 +952,20 @@ static uint8_t argumentList() {
 }
 
 static void and_(bool canAssign) {
+    int leftStart = parser.leftStart;
+    Value left;
+    if (constantAt(leftStart, &left)) {
+        if (isFalsey(left)) {
+            int end = currentChunk()->count;
+            parsePrecedence(PREC_AND);
+            currentChunk()->count = end;
+        } else {
+            currentChunk()->count = leftStart;
+            parsePrecedence(PREC_AND);
+        }
+        return;
+    }
+
     int endJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     parsePrecedence(PREC_AND);
@@ -413,9 +977,77 @@ static void binaryOp(const char* name) {
     new.length = 1;
     new.start = name;
 
-    uint8_t op = OP_BINARY;
-    int arg = identifierConstant(&new);
-    emitBytes(op, (uint8_t)arg);
+    emitConstantOp(OP_BINARY, identifierConstant(&new));
+}
+
+static int operatorConstant(const char* name) {
+    Token token;
+    token.length = 1;
+    token.start = name;
+    return identifierConstant(&token);
+}
+
+// Compiles the right-hand side of a compound assignment, which is a 1 for
+// ++ and --, and returns the operator it applies
+static const char* compoundOperand() {
+    TokenType type = parser.previous.type;
+    if (type == TOKEN_PLUS_PLUS || type == TOKEN_MINUS_MINUS) {
+        emitConstant(NUMBER_VAL(1));
+    } else {
+        expression();
+    }
+
+    switch (type) {
+        case TOKEN_PLUS_EQUAL:
+        case TOKEN_PLUS_PLUS:
+            return "+";
+        case TOKEN_MINUS_EQUAL:
+        case TOKEN_MINUS_MINUS:
+            return "-";
+        case TOKEN_STAR_EQUAL:
+            return "*";
+        default:
+            return "/";
+    }
+}
+
+// Emits an instruction whose operands are a slot or a constant followed by
+// a constant, in the long form if either constant needs it
+static void emitPairOp(uint8_t op, int first, bool firstIsConstant, int second) {
+    bool isLong = second > UINT8_MAX || (firstIsConstant && first > UINT8_MAX);
+    emitByte(isLong ? op | OP_LONG : op);
+    if (firstIsConstant) {
+        emitIndex(first, isLong);
+    } else {
+        emitByte((uint8_t)first);
+    }
+    emitIndex(second, isLong);
+}
+
+static void emitScalarOp(uint8_t op, uint8_t slot, int field, int name) {
+    emitByte(name > UINT8_MAX ? op | OP_LONG : op);
+    emitBytes(slot, (uint8_t)field);
+    emitIndex(name, name > UINT8_MAX);
+}
+
+// x += constant and x++ on locals and upvalues add the constant in place.
+// Everything else reads, combines and writes the variable in one
+// instruction, which for globals means a single hash lookup. x -= c adds -c,
+// so only constants without a sign bit are folded: the VM takes a negative
+// one to mean a subtraction when it reports a type error.
+static void compoundVariable(uint8_t op, int arg, const char* operator, uint8_t isSet, int start) {
+    Value value;
+    if (op != OP_GLOBAL && constantAt(start, &value) && (!IS_NUMBER(value) || !signbit(AS_NUMBER(value))) &&
+        (operator[0] == '+' || (operator[0] == '-' && IS_NUMBER(value)))) {
+        currentChunk()->count = start;
+        if (operator[0] == '-') value = NUMBER_VAL(-AS_NUMBER(value));
+        emitPairOp(op == OP_LOCAL ? OP_ADD_LOCAL_CONST : OP_ADD_UPVALUE_CONST, arg, false, makeConstant(value));
+    } else if (op == OP_GLOBAL) {
+        emitPairOp(OP_COMPOUND_GLOBAL, arg, true, operatorConstant(operator));
+    } else {
+        emitPairOp(op == OP_LOCAL ? OP_COMPOUND_LOCAL : OP_COMPOUND_UPVALUE, arg, false, operatorConstant(operator));
+    }
+    emitByte(isSet);
 }
 
 static void compareOp(const char* name) {
@@ -423,15 +1055,28 @@ static void compareOp(const char* name) {
     new.length = 1;
     new.start = name;
 
-    uint8_t op = OP_COMPARE;
-    int arg = identifierConstant(&new);
-    emitBytes(op, (uint8_t)arg);
+    emitConstantOp(OP_COMPARE, identifierConstant(&new));
 }
 
 static void binary(bool canAssign) {
+    int leftStart = parser.leftStart;
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+
+    Value left;
+    bool leftConstant = constantAt(leftStart, &left);
+    int rightStart = currentChunk()->count;
+    // ** is right associative and binds tighter than a unary minus on its
+    // left, but not on its right: -2 ** 2 is -4 and 2 ** -1 is 0.5
+    parsePrecedence(operatorType == TOKEN_STAR_STAR ? PREC_UNARY : (Precedence)(rule->precedence + 1));
+
+    Value right;
+    Value result;
+    if (leftConstant && constantAt(rightStart, &right) && foldBinary(operatorType, left, right, &result)) {
+        currentChunk()->count = leftStart;
+        emitValue(result);
+        return;
+    }
 
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    compareOp("="); compareOp("!"); break;
@@ -444,28 +1089,72 @@ static void binary(bool canAssign) {
         case TOKEN_MINUS:         binaryOp("-"); break;
         case TOKEN_STAR:          binaryOp("*"); break;
         case TOKEN_SLASH:         binaryOp("/"); break;
+        case TOKEN_PERCENT:       emitByte(OP_MODULO); break;
+        case TOKEN_TILDE_SLASH:   emitByte(OP_FLOOR_DIVIDE); break;
+        case TOKEN_STAR_STAR:     emitByte(OP_POWER); break;
+        case TOKEN_AMPERSAND:     emitByte(OP_BIT_AND); break;
+        case TOKEN_PIPE:          emitByte(OP_BIT_OR); break;
+        case TOKEN_CARET:         emitByte(OP_BIT_XOR); break;
+        case TOKEN_LESS_LESS:     emitByte(OP_SHIFT_LEFT); break;
+        case TOKEN_GREATER_GREATER: emitByte(OP_SHIFT_RIGHT); break;
         default: return;
     }
 }
 
 static void call(bool canAssign) {
+    int calleeStart = parser.leftStart;
     uint8_t argCount = argumentList();
+    if (foldNativeCall(calleeStart, argCount)) return;
+
     emitBytes(OP_CALL, argCount);
 }
 
 static void dot(bool canAssign) {
+    int leftStart = parser.leftStart;
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
+
+    Chunk* chunk = currentChunk();
+    if (chunk->count - leftStart == 3 && chunk->code[leftStart] == OP_LOCAL && chunk->code[leftStart + 2] == 0 &&
+        current->locals[chunk->code[leftStart + 1]].scalar != NULL && !check(TOKEN_LEFT_PAREN)) {
+        uint8_t slot = chunk->code[leftStart + 1];
+        int field = scalarSlot(&current->locals[slot], slot, AS_STRING(chunk->constants.values[name]));
+        if (field != -1) {
+            chunk->count = leftStart;
+            uint8_t op = OP_SCALAR_GET;
+            if (canAssign && match(TOKEN_EQUAL)) {
+                expression();
+                op = OP_SCALAR_SET;
+            } else if (canAssign && isCompound(parser.current.type)) {
+                advance();
+                bool postfix = compoundStore(parser.previous.type) == POSTFIX;
+                if (postfix) emitScalarOp(OP_SCALAR_GET, slot, field, name);
+                emitScalarOp(OP_SCALAR_GET, slot, field, name);
+                binaryOp(compoundOperand());
+                emitScalarOp(OP_SCALAR_SET, slot, field, name);
+                if (postfix) emitByte(OP_POP);
+                return;
+            }
+            emitScalarOp(op, slot, field, name);
+            return;
+        }
+    }
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitConstantOp(OP_SET_PROPERTY, name);
+    } else if (canAssign && isCompound(parser.current.type)) {
+        advance();
+        uint8_t isSet = compoundStore(parser.previous.type);
+        const char* operator = compoundOperand();
+        emitPairOp(OP_COMPOUND_PROPERTY, name, true, operatorConstant(operator));
+        emitByte(isSet);
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        emitConstantOp(OP_INVOKE, name);
         emitByte(argCount);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitConstantOp(OP_GET_PROPERTY, name);
     }
 }
 
@@ -489,6 +1178,20 @@ static void number(bool canAssign) {
 }
 
 static void or_(bool canAssign) {
+    int leftStart = parser.leftStart;
+    Value left;
+    if (constantAt(leftStart, &left)) {
+        if (!isFalsey(left)) {
+            int end = currentChunk()->count;
+            parsePrecedence(PREC_OR);
+            currentChunk()->count = end;
+        } else {
+            currentChunk()->count = leftStart;
+            parsePrecedence(PREC_OR);
+        }
+        return;
+    }
+
     int elseJump = emitJump(OP_JUMP_IF_FALSE);
     int endJump = emitJump(OP_JUMP);
 
@@ -503,9 +1206,91 @@ static void string(bool canAssign) {
     emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+// Each part of a template string is pushed, leaving out empty text, and
+// OP_BUILD_STRING joins them into one string at the end. If every part is
+// a constant the string is built here instead.
+static void interpolation(bool canAssign) {
+    int start = currentChunk()->count;
+    Value parts[UINT8_COUNT];
+    int partCount = 0;
+    bool folds = true;
+    do {
+        // The text starts after the " or } and stops before the ${
+        if (parser.previous.length > 3) {
+            Value text = OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 3));
+            emitConstant(text);
+            if (partCount < UINT8_COUNT) parts[partCount] = text;
+            partCount++;
+        }
+
+        int partStart = currentChunk()->count;
+        expression();
+        Value value;
+        folds = folds && constantAt(partStart, &value) && (IS_NUMBER(value) || IS_STRING(value));
+        if (folds && partCount < UINT8_COUNT) parts[partCount] = value;
+        partCount++;
+    } while (match(TOKEN_INTERPOLATION));
+
+    consume(TOKEN_STRING, "Expect end of string after interpolation.");
+    if (parser.previous.length > 2) {
+        Value text = OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2));
+        emitConstant(text);
+        if (partCount < UINT8_COUNT) parts[partCount] = text;
+        partCount++;
+    }
+
+    if (partCount > UINT8_MAX) {
+        error("Too many parts in one string.");
+    } else if (folds) {
+        // With no room left under the heap limit the string is built at
+        // run time instead, where that can be thrown
+        ObjString* folded = buildString(parts, partCount);
+        if (folded != NULL) {
+            currentChunk()->count = start;
+            emitConstant(OBJ_VAL(folded));
+            return;
+        }
+    }
+    emitBytes(OP_BUILD_STRING, (uint8_t)partCount);
+}
+
+// Finds a variable of an enclosing function that was propagated as a
+// constant, so inner functions can use the value instead of capturing it
+static bool resolveConstant(Compiler* compiler, Token* name, Value* value) {
+    for (; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            Local* local = &compiler->locals[i];
+            if (identifiersEqual(name, &local->name)) {
+                if (!local->hasConstant) return false;
+                *value = local->constant;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 static void namedVariable(Token name, bool canAssign) {
     uint8_t op;
+    bool isAssignment = canAssign && (check(TOKEN_EQUAL) || isCompound(parser.current.type));
+    NamedConstant* named = resolveNamedConstant(&name);
+    if (named != NULL) {
+        if (isAssignment) error("Can't assign to a constant.");
+        emitValue(named->value);
+        return;
+    }
+
     int arg = resolveLocal(current, &name);
+    Value constant;
+
+    if (arg != -1 && current->locals[arg].hasConstant && !isAssignment) {
+        emitBytes(current->locals[arg].constantOp, current->locals[arg].constantIndex);
+        return;
+    } else if (arg == -1 && !isAssignment && resolveConstant(current->enclosing, &name, &constant)) {
+        emitValue(constant);
+        return;
+    }
 
     if (arg != -1) {
         op = OP_LOCAL;
@@ -518,10 +1303,15 @@ static void namedVariable(Token name, bool canAssign) {
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(op, (uint8_t)arg);
+        emitConstantOp(op, arg);
         emitByte(1);
+    } else if (canAssign && isCompound(parser.current.type)) {
+        advance();
+        uint8_t isSet = compoundStore(parser.previous.type);
+        int start = currentChunk()->count;
+        compoundVariable(op, arg, compoundOperand(), isSet, start);
     } else {
-        emitBytes(op, (uint8_t)arg);
+        emitConstantOp(op, arg);
         emitByte(0);
     }
 }
@@ -546,17 +1336,17 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
     
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitConstantOp(OP_SUPER_INVOKE, name);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitConstantOp(OP_GET_SUPER, name);
     }
 }
 
@@ -571,7 +1361,21 @@ static void this_(bool canAssign) {
 
 static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
+    int start = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
+
+    Value value;
+    if (constantAt(start, &value)) {
+        if (operatorType == TOKEN_BANG) {
+            currentChunk()->count = start;
+            emitValue(BOOL_VAL(isFalsey(value)));
+            return;
+        } else if (operatorType == TOKEN_MINUS && IS_NUMBER(value)) {
+            currentChunk()->count = start;
+            emitValue(NUMBER_VAL(-AS_NUMBER(value)));
+            return;
+        }
+    }
     switch (operatorType) {
         case TOKEN_BANG: compareOp("!"); break;
         case TOKEN_MINUS: emitByte(OP_UNARY); break;
@@ -591,6 +1395,7 @@ ParseRule rules[] = {
     [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
     [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
     [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
+    [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE},
     [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
     [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
@@ -599,8 +1404,23 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_PLUS_EQUAL]    = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_MINUS_EQUAL]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_STAR_EQUAL]    = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_SLASH_EQUAL]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_PLUS_PLUS]     = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_MINUS_MINUS]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_PERCENT]       = {NULL,     binary, PREC_FACTOR},
+    [TOKEN_TILDE_SLASH]   = {NULL,     binary, PREC_FACTOR},
+    [TOKEN_STAR_STAR]     = {NULL,     binary, PREC_POWER},
+    [TOKEN_AMPERSAND]     = {NULL,     binary, PREC_BIT_AND},
+    [TOKEN_PIPE]          = {NULL,     binary, PREC_BIT_OR},
+    [TOKEN_CARET]         = {NULL,     binary, PREC_BIT_XOR},
+    [TOKEN_LESS_LESS]     = {NULL,     binary, PREC_SHIFT},
+    [TOKEN_GREATER_GREATER] = {NULL,   binary, PREC_SHIFT},
     [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
     [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
+    [TOKEN_INTERPOLATION] = {interpolation, NULL, PREC_NONE},
     [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
     [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
     [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
@@ -617,11 +1437,19 @@ ParseRule rules[] = {
     [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
     [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_TRY]           = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_CATCH]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_THROW]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_SWITCH]        = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_CASE]          = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_DEFAULT]       = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_CONST]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
 static void parsePrecedence(Precedence precedence) {
+    int start = currentChunk()->count;
     advance();
     ParseFn prefixRule = getRule(parser.previous.type)->prefix;
     if (prefixRule == NULL) {
@@ -635,10 +1463,11 @@ static void parsePrecedence(Precedence precedence) {
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        parser.leftStart = start;
         infixRule(canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
+    if (canAssign && (match(TOKEN_EQUAL) || isCompound(parser.current.type))) {
         error("Invalid assignment target.");
     }
 }
@@ -659,11 +1488,7 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
-
+static void functionBody() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
     if (!check(TOKEN_RIGHT_PAREN)) {
         do {
@@ -671,46 +1496,161 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
+}
 
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+// Scans past the parameters and body if they can be compiled later: the
+// braces balance and the body names no local, this or super from the
+// functions around it, so it needs no upvalues. Returns the arity with the
+// closing brace as the current token, or -1 with nothing consumed.
+static int skipBody(FunctionType type) {
+    if (parser.bodies == BODIES_WHOLE || type == TYPE_INITIALIZER || !check(TOKEN_LEFT_PAREN)) return -1;
+    Scanner saved = parser.scanner;
+
+    int arity = 0;
+    Token token = scanToken(&parser.scanner);
+    while (token.type != TOKEN_RIGHT_PAREN) {
+        if (token.type != TOKEN_IDENTIFIER || ++arity > 255) break;
+        token = scanToken(&parser.scanner);
+        if (token.type == TOKEN_COMMA) token = scanToken(&parser.scanner);
+        else if (token.type != TOKEN_RIGHT_PAREN) break;
+    }
+
+    int depth = 0;
+    if (token.type == TOKEN_RIGHT_PAREN) {
+        token = scanToken(&parser.scanner);
+        if (token.type == TOKEN_LEFT_BRACE) depth = 1;
+    }
+
+    while (depth > 0) {
+        token = scanToken(&parser.scanner);
+        if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE) {
+            depth--;
+        } else if (token.type == TOKEN_ERROR || token.type == TOKEN_EOF || token.type == TOKEN_SUPER ||
+                   (token.type == TOKEN_THIS && type == TYPE_FUNCTION) ||
+                   (token.type == TOKEN_IDENTIFIER && isLocalName(&token))) {
+            break;
+        }
+    }
+
+    if (depth > 0 || token.type != TOKEN_RIGHT_BRACE) {
+        parser.scanner = saved;
+        return -1;
+    }
+    parser.current = token;
+    return arity;
+}
+
+static LazyBody* newLazyBody(FunctionType type, Token* start) {
+    if (lazySource == NULL) {
+        lazySource = ALLOCATE(LazySource, 1);
+        lazySource->length = parser.sourceLength;
+        lazySource->chars = ALLOCATE(char, lazySource->length + 1);
+        memcpy(lazySource->chars, parser.source, lazySource->length + 1);
+        lazySource->refs = 0;
+        lazySource->shadowedNatives = -1;
+    }
+
+    LazyBody* body = ALLOCATE(LazyBody, 1);
+    body->source = lazySource;
+    body->offset = (int)(start->start - parser.source);
+    body->line = start->line;
+    body->type = type;
+    body->constantCount = namedConstantCount;
+    body->constants = ALLOCATE(NamedConstant, namedConstantCount);
+    for (int i = 0; i < namedConstantCount; i++) {
+        NamedConstant* constant = &body->constants[i];
+        *constant = namedConstants[i];
+        constant->name.start = lazySource->chars + (constant->name.start - parser.source);
+        constant->compiler = NULL;
+        constant->depth = 0;
+        constant->localCount = 0;
+    }
+    lazySource->refs++;
+    return body;
+}
+
+static ObjFunction* function(FunctionType type) {
+    ObjFunction* function;
+    Compiler compiler;
+
+    Token name = parser.previous;
+    Token parameters = parser.current;
+    int arity = skipBody(type);
+    if (arity >= 0) {
+        LazyBody* body = newLazyBody(type, &parameters);
+        function = newFunction();
+        function->lazy = body;
+        function->arity = arity;
+        // The constant keeps it reachable from here on
+        makeConstant(OBJ_VAL(function));
+        function->name = copyString(name.start, name.length);
+        if (parser.bodies == BODIES_LAZY) {
+            deferredCount++;
+        } else {
+            if (pendingCapacity < pendingCount + 1) {
+                int oldCapacity = pendingCapacity;
+                pendingCapacity = GROW_CAPACITY(oldCapacity);
+                pendingBodies = GROW_ARRAY(ObjFunction*, pendingBodies, oldCapacity, pendingCapacity);
+            }
+            pendingBodies[pendingCount++] = function;
+        }
+        advance();
+    } else {
+        initCompiler(&compiler, type, NULL);
+        beginScope();
+        functionBody();
+        function = endCompiler();
+    }
+
+    if (type == TYPE_METHOD || (current->type == TYPE_SCRIPT && current->scopeDepth == 0)) {
+        addInlineCandidate(function, type == TYPE_METHOD);
+    }
+    emitConstantOp(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
         emitByte(compiler.upvalues[i].index);
     }
+
+    return function;
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
     
-    function(type);
-    emitBytes(OP_METHOD, constant);
+    // Methods are only reached through bound methods, which are new each time
+    ObjFunction* method = function(type);
+    method->shareClosure = true;
+    if (type == TYPE_INITIALIZER) currentClass->initializer = method;
+    emitConstantOp(OP_METHOD, constant);
 }
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
+    emitConstantOp(OP_CLASS, nameConstant);
     defineVariable(nameConstant);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
+    classCompiler.initializer = NULL;
     classCompiler.enclosing = currentClass;
     currentClass = &classCompiler;
 
@@ -743,28 +1683,326 @@ static void classDeclaration() {
         endScope();
     }
 
+    if (current->type == TYPE_SCRIPT && current->scopeDepth == 0 && !classCompiler.hasSuperclass) {
+        addScalarClass(&className, classCompiler.initializer);
+    }
+
     currentClass = currentClass->enclosing;
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
+    Token name = parser.previous;
     markInitialized();
-    function(TYPE_FUNCTION);
+    ObjFunction* declared = function(TYPE_FUNCTION);
+    // A top-level def lands in a global, where any file could compare it
+    if (current->scopeDepth > 0) {
+        declared->shareClosure = onlyCalledAhead(parser.scanner, &name, parser.previous, parser.current);
+    }
     defineVariable(global);
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+// Reads the fields an initializer sets, which works only if it is nothing
+// but this.field = parameter or constant statements
+static bool readInitializer(ScalarClass* scalar) {
+    Chunk* chunk = &scalar->initializer->chunk;
+    scalar->fieldCount = 0;
+
+    int offset = 0;
+    while (offset + 8 <= chunk->count) {
+        uint8_t* code = &chunk->code[offset];
+        if (code[0] != OP_LOCAL || code[1] != 0 || code[2] != 0) return false;
+        if (code[3] == OP_LOCAL && code[5] == 0 && code[4] >= 1 && code[4] <= scalar->initializer->arity) {
+            offset += 6;
+        } else if (code[3] == OP_CONSTANT || code[3] == OP_BOOL) {
+            offset += 5;
+        } else {
+            return false;
+        }
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
-    } else {
-        boolOp("NULL");
-    }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+        if (chunk->code[offset] != OP_SET_PROPERTY || chunk->code[offset + 2] != OP_POP) return false;
+        ObjString* field = AS_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+        int index = 0;
+        while (index < scalar->fieldCount && scalar->fields[index] != field) index++;
+        if (index == SCALAR_MAX_FIELDS) return false;
+        if (index == scalar->fieldCount) scalar->fieldCount++;
 
-    defineVariable(global);
-}
+        scalar->fields[index] = field;
+        if (code[3] == OP_LOCAL) {
+            scalar->parameters[index] = code[4];
+        } else {
+            scalar->parameters[index] = 0;
+            Value constant = chunk->constants.values[code[4]];
+            if (code[3] == OP_BOOL) {
+                const char* name = AS_CSTRING(constant);
+                constant = strcmp(name, "TRUE") == 0 ? BOOL_VAL(true) : strcmp(name, "FALS") == 0 ? BOOL_VAL(false) : NULL_VAL;
+            }
+            scalar->constants[index] = constant;
+        }
+        offset += 3;
+    }
+
+    return offset + 4 == chunk->count && chunk->code[offset] == OP_LOCAL &&
+        chunk->code[offset + 1] == 0 && chunk->code[offset + 3] == OP_RETURN;
+}
+
+static void addScalarClass(Token* name, ObjFunction* initializer) {
+    ObjString* className = copyString(name->start, name->length);
+    for (int i = 0; i < scalarClassCount; i++) {
+        if (scalarClasses[i].name == className) {
+            // A class declared twice could be either one at runtime
+            scalarClasses[i].initializer = NULL;
+            return;
+        }
+    }
+
+    if (scalarClassCapacity < scalarClassCount + 1) {
+        int oldCapacity = scalarClassCapacity;
+        scalarClassCapacity = GROW_CAPACITY(oldCapacity);
+        scalarClasses = GROW_ARRAY(ScalarClass, scalarClasses, oldCapacity, scalarClassCapacity);
+    }
+
+    ScalarClass* scalar = &scalarClasses[scalarClassCount++];
+    scalar->name = className;
+    scalar->initializer = initializer;
+    if (initializer == NULL || !readInitializer(scalar)) scalar->initializer = NULL;
+}
+
+// A field kept in the slot of the argument it was set from. A field set from
+// a parameter an earlier field already uses gets a slot of its own with a
+// copy, so storing to one doesn't change the other.
+static bool inArgumentSlot(ScalarClass* scalar, int field) {
+    if (scalar->parameters[field] == 0) return false;
+    for (int i = 0; i < field; i++) {
+        if (scalar->parameters[i] == scalar->parameters[field]) return false;
+    }
+    return true;
+}
+
+static int scalarField(ScalarClass* scalar, ObjString* name) {
+    for (int i = 0; i < scalar->fieldCount; i++) {
+        if (scalar->fields[i] == name) return i;
+    }
+    return -1;
+}
+
+static bool isLocalName(Token* name) {
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            if (identifiersEqual(name, &compiler->locals[i].name)) return true;
+        }
+    }
+    return false;
+}
+
+// The instance doesn't escape if the rest of the block only reads and
+// writes its fields. Anything else, including nested functions that could
+// capture it, counts as an escape.
+static bool escapesAhead(Scanner scanner, Token* name, ScalarClass* scalar, Token previous, Token token) {
+    bool escapes = false;
+    int depth = 0;
+
+    while (token.type != TOKEN_EOF && !escapes) {
+        if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE && depth-- == 0) {
+            break;
+        } else if (token.type == TOKEN_FUN || token.type == TOKEN_CLASS) {
+            escapes = true;
+            break;
+        }
+
+        if (token.type == TOKEN_IDENTIFIER && previous.type != TOKEN_DOT && identifiersEqual(&token, name)) {
+            Token dot = scanToken(&scanner);
+            Token field = scanToken(&scanner);
+            Token after = scanToken(&scanner);
+            escapes = previous.type == TOKEN_VAR || dot.type != TOKEN_DOT || field.type != TOKEN_IDENTIFIER ||
+                after.type == TOKEN_LEFT_PAREN ||
+                scalarField(scalar, copyString(field.start, field.length)) == -1;
+            previous = field;
+            token = after;
+            continue;
+        }
+
+        previous = token;
+        token = scanToken(&scanner);
+    }
+
+    return escapes;
+}
+
+// Looks for int name = Class(arguments); where Class is a scalar class and
+// the instance never escapes
+static ScalarClass* scalarDeclaration(Token* name) {
+    if (optimizationLevel == 0 || current->scopeDepth == 0 || !check(TOKEN_EQUAL)) return NULL;
+
+    Scanner scanner = parser.scanner;
+    Token className = scanToken(&scanner);
+    Token paren = scanToken(&scanner);
+    ScalarClass* scalar = NULL;
+    if (className.type == TOKEN_IDENTIFIER && paren.type == TOKEN_LEFT_PAREN && !isLocalName(&className)) {
+        ObjString* string = copyString(className.start, className.length);
+        for (int i = 0; i < scalarClassCount; i++) {
+            if (scalarClasses[i].name == string && scalarClasses[i].initializer != NULL) {
+                scalar = &scalarClasses[i];
+            }
+        }
+    }
+
+    int argCount = 0;
+    if (scalar != NULL) {
+        Token token = scanToken(&scanner);
+        int depth = 1;
+        bool empty = token.type == TOKEN_RIGHT_PAREN;
+        while (token.type != TOKEN_EOF) {
+            if (token.type == TOKEN_LEFT_PAREN) depth++;
+            if (token.type == TOKEN_RIGHT_PAREN && --depth == 0) break;
+            if (token.type == TOKEN_COMMA && depth == 1) argCount++;
+            token = scanToken(&scanner);
+        }
+        if (!empty) argCount++;
+
+        Token semicolon = scanToken(&scanner);
+        Token next = scanToken(&scanner);
+        if (semicolon.type != TOKEN_SEMICOLON || argCount != scalar->initializer->arity ||
+            escapesAhead(scanner, name, scalar, semicolon, next)) {
+            scalar = NULL;
+        }
+    }
+
+    return scalar;
+}
+
+// The class and the arguments stay on the stack as hidden locals, followed
+// by the constant fields and the copied arguments. If at runtime the global isn't the class that was
+// analyzed, the instance is made for real and the hidden locals are padded.
+static bool scalarVariable(ScalarClass* scalar) {
+    int initializer = makeConstant(OBJ_VAL(scalar->initializer));
+    if (initializer > UINT8_MAX) return false;
+
+    int slot = current->localCount - 1;
+    consume(TOKEN_EQUAL, "Expect '='.");
+    consume(TOKEN_IDENTIFIER, "Expect class name.");
+    namedVariable(parser.previous, false);
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after class name.");
+    uint8_t argCount = argumentList();
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    int extraCount = 0;
+    for (int i = 0; i < scalar->fieldCount; i++) {
+        if (inArgumentSlot(scalar, i)) continue;
+
+        if (scalar->parameters[i] == 0) {
+            emitValue(scalar->constants[i]);
+        } else {
+            emitBytes(OP_LOCAL, (uint8_t)(slot + scalar->parameters[i]));
+            emitByte(0);
+        }
+        extraCount++;
+    }
+
+    current->locals[slot].depth = current->scopeDepth;
+    current->locals[slot].scalar = scalar;
+    current->locals[slot].argCount = argCount;
+    for (int i = 0; i < argCount + extraCount; i++) {
+        addLocal(syntheticToken(""));
+        markInitialized();
+    }
+
+    emitBytes(OP_SCALAR_NEW, argCount);
+    emitBytes(extraCount, (uint8_t)initializer);
+    emitBytes(0xff, 0xff);
+    int scalarJump = currentChunk()->count - 2;
+
+    for (int i = 0; i < extraCount; i++) {
+        emitByte(OP_POP);
+    }
+    emitBytes(OP_CALL, argCount);
+    for (int i = 0; i < argCount + extraCount; i++) {
+        boolOp("NULL");
+    }
+    patchJump(scalarJump);
+    return true;
+}
+
+// The slot holding the field of a scalar replaced instance
+static int scalarSlot(Local* local, int slot, ObjString* name) {
+    int field = scalarField(local->scalar, name);
+    if (field == -1) return -1;
+    if (inArgumentSlot(local->scalar, field)) return slot + local->scalar->parameters[field];
+
+    int extra = 0;
+    for (int i = 0; i < field; i++) {
+        if (!inArgumentSlot(local->scalar, i)) extra++;
+    }
+    return slot + local->argCount + 1 + extra;
+}
+
+static void varDeclaration() {
+    int global = parseVariable("Expect variable name.");
+    Token name = parser.previous;
+    int start = currentChunk()->count;
+
+    ScalarClass* scalar = scalarDeclaration(&name);
+    if (scalar != NULL && scalarVariable(scalar)) return;
+
+    if (match(TOKEN_EQUAL)) {
+        expression();
+    } else {
+        boolOp("NULL");
+    }
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    // A local that starts out constant and is never stored to again has its
+    // reads replaced by the constant
+    Value value;
+    Local* local = &current->locals[current->localCount - 1];
+    if (current->scopeDepth > 0 && local->depth == -1 && constantAt(start, &value) &&
+        currentChunk()->count - start == 2 && !storedAhead(parser.scanner, &name, parser.previous, parser.current)) {
+        local->hasConstant = true;
+        local->constant = value;
+        local->constantOp = currentChunk()->code[start];
+        local->constantIndex = currentChunk()->code[start + 1];
+    }
+
+    defineVariable(global);
+}
+
+static void constDeclaration() {
+    consume(TOKEN_IDENTIFIER, "Expect constant name.");
+    Token name = parser.previous;
+    checkNamedConstants(&name);
+    for (int i = current->localCount - 1; i >= 0 && current->locals[i].depth >= current->scopeDepth; i--) {
+        if (identifiersEqual(&name, &current->locals[i].name)) {
+            error("Already a variable with this name in this scope.");
+        }
+    }
+
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+    int start = currentChunk()->count;
+    bool inConstant = parser.inConstant;
+    parser.inConstant = true;
+    expression();
+    parser.inConstant = inConstant;
+    Value value = NULL_VAL;
+    if (!constantAt(start, &value)) {
+        error("Constant value must be known at compile time.");
+    }
+    currentChunk()->count = start;
+    consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+    if (namedConstantCapacity < namedConstantCount + 1) {
+        int oldCapacity = namedConstantCapacity;
+        namedConstantCapacity = GROW_CAPACITY(oldCapacity);
+        namedConstants = GROW_ARRAY(NamedConstant, namedConstants, oldCapacity, namedConstantCapacity);
+    }
+    NamedConstant* constant = &namedConstants[namedConstantCount++];
+    constant->name = name;
+    constant->value = value;
+    constant->compiler = current;
+    constant->depth = current->scopeDepth;
+    constant->localCount = current->localCount;
+}
 
 static void expressionStatement() {
     expression();
@@ -772,6 +2010,93 @@ static void expressionStatement() {
     emitByte(OP_POP);
 }
 
+// Loops of the form for (int i = ...; i < limit; i = i + step) { ... }
+// where limit is a number or a local, step is a number and the body never
+// stores to i, are compiled to OP_FOR_LOOP and OP_FOR_STEP. Those check the
+// types at runtime, so they still fail the same way the long form would.
+static bool countedForStatement() {
+    uint8_t slot = current->localCount - 1;
+    Token name = current->locals[slot].name;
+
+    Scanner scanner = parser.scanner;
+    Token tokens[11];
+    tokens[0] = parser.current;
+    for (int i = 1; i < 6; i++) {
+        tokens[i] = scanToken(&scanner);
+    }
+
+    // The increment is i = i + step, i += step or i++
+    int count = tokens[5].type == TOKEN_PLUS_PLUS ? 8 : tokens[5].type == TOKEN_PLUS_EQUAL ? 9 : 11;
+    for (int i = 6; i < count; i++) {
+        tokens[i] = scanToken(&scanner);
+    }
+    Token* stepToken = count == 11 ? &tokens[8] : count == 9 ? &tokens[6] : NULL;
+
+    bool counted = tokens[0].type == TOKEN_IDENTIFIER && identifiersEqual(&tokens[0], &name) &&
+        (tokens[1].type == TOKEN_LESS || tokens[1].type == TOKEN_LESS_EQUAL) &&
+        (tokens[2].type == TOKEN_NUMBER || tokens[2].type == TOKEN_IDENTIFIER) &&
+        tokens[3].type == TOKEN_SEMICOLON &&
+        tokens[4].type == TOKEN_IDENTIFIER && identifiersEqual(&tokens[4], &name) &&
+        (count != 11 || (tokens[5].type == TOKEN_EQUAL &&
+            tokens[6].type == TOKEN_IDENTIFIER && identifiersEqual(&tokens[6], &name) &&
+            tokens[7].type == TOKEN_PLUS)) &&
+        (stepToken == NULL || stepToken->type == TOKEN_NUMBER) &&
+        tokens[count - 2].type == TOKEN_RIGHT_PAREN &&
+        tokens[count - 1].type == TOKEN_LEFT_BRACE;
+    if (counted) {
+        Token next = scanToken(&scanner);
+        counted = !storedAhead(scanner, &name, tokens[count - 1], next);
+    }
+    if (!counted) return false;
+
+    uint8_t mode = tokens[1].type == TOKEN_LESS_EQUAL ? FOR_INCLUSIVE : 0;
+    int limit = -1;
+    NamedConstant* named = tokens[2].type == TOKEN_IDENTIFIER ? resolveNamedConstant(&tokens[2]) : NULL;
+    if (named != NULL) {
+        if (!IS_NUMBER(named->value)) return false;
+        mode |= FOR_CONSTANT_LIMIT;
+        limit = makeConstant(named->value);
+    } else if (tokens[2].type == TOKEN_IDENTIFIER) {
+        int arg = resolveLocal(current, &tokens[2]);
+        if (arg == -1) return false;
+
+        Local* local = &current->locals[arg];
+        if (!local->hasConstant) {
+            limit = arg;
+        } else if (local->constantOp == OP_CONSTANT) {
+            mode |= FOR_CONSTANT_LIMIT;
+            limit = local->constantIndex;
+        } else {
+            return false;
+        }
+    } else {
+        mode |= FOR_CONSTANT_LIMIT;
+        limit = makeConstant(NUMBER_VAL(strtod(tokens[2].start, NULL)));
+    }
+    int step = makeConstant(NUMBER_VAL(stepToken != NULL ? strtod(stepToken->start, NULL) : 1));
+    if (limit > UINT8_MAX || step > UINT8_MAX) return false;
+
+    for (int i = 0; i < count - 1; i++) {
+        advance();
+    }
+
+    emitBytes(OP_FOR_LOOP, slot);
+    emitBytes(mode, (uint8_t)limit);
+    emitBytes(0xff, 0xff);
+    int exitJump = currentChunk()->count - 2;
+
+    int bodyStart = currentChunk()->count;
+    statement();
+
+    emitBytes(OP_FOR_STEP, slot);
+    emitBytes(mode, (uint8_t)limit);
+    emitByte((uint8_t)step);
+    emitLoopOffset(bodyStart);
+
+    patchJump(exitJump);
+    return true;
+}
+
 static void forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
@@ -779,6 +2104,10 @@ static void forStatement() {
         // No initializer.
     } else if (match(TOKEN_VAR)) {
         varDeclaration();
+        if (!parser.hadError && countedForStatement()) {
+            endScope();
+            return;
+        }
     } else {
         expressionStatement();
     }
@@ -832,6 +2161,142 @@ static void ifStatement() {
     patchJump(elseJump);
 }
 
+// Integer cases that fill at least half of the range between the lowest
+// and the highest get a table indexed by the value. Anything else is
+// hashed, with at most half of the slots in use.
+static ObjJumpTable* buildJumpTable(Value* values, int* targets, int count, int defaultTarget, bool* dense) {
+    double low = 0;
+    double high = -1;
+    *dense = count > 0;
+    for (int i = 0; i < count && *dense; i++) {
+        double number = IS_NUMBER(values[i]) ? AS_NUMBER(values[i]) : 0.5;
+        *dense = number >= -INT32_MAX / 2 && number <= INT32_MAX / 2 && number == (int)number;
+        if (i == 0 || number < low) low = number;
+        if (i == 0 || number > high) high = number;
+    }
+    if (*dense && high - low + 1 > count * 2.0) *dense = false;
+
+    ObjJumpTable* table;
+    if (*dense) {
+        table = newJumpTable((int)(high - low) + 1, false);
+        table->low = low;
+        for (int i = 0; i <= table->count; i++) {
+            table->targets[i] = -1;
+        }
+        for (int i = 0; i < count; i++) {
+            int* target = &table->targets[(int)(AS_NUMBER(values[i]) - low)];
+            if (*target != -1) error("Duplicate case value.");
+            *target = targets[i];
+        }
+        for (int i = 0; i <= table->count; i++) {
+            if (table->targets[i] == -1) table->targets[i] = defaultTarget;
+        }
+        return table;
+    }
+
+    int capacity = 8;
+    while (capacity < count * 2) capacity *= 2;
+    table = newJumpTable(capacity, true);
+    for (int i = 0; i <= capacity; i++) {
+        table->targets[i] = defaultTarget;
+    }
+    for (int i = 0; i < count; i++) {
+        uint32_t index = hashValue(values[i]) & (capacity - 1);
+        while (table->keys[index] != NULL_VAL && table->keys[index] != values[i]) {
+            index = (index + 1) & (capacity - 1);
+        }
+        if (table->keys[index] == values[i]) error("Duplicate case value.");
+        table->keys[index] = values[i];
+        table->targets[index] = targets[i];
+    }
+    return table;
+}
+
+// Cases don't fall through, each one jumps to the end of the switch when
+// its statements finish
+static void switchStatement() {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+
+    // The table can only be built once every case is compiled, so its
+    // constant is added outside the deduplication map and filled in later
+    int constant = addConstant(currentChunk(), NULL_VAL);
+    int dispatch = currentChunk()->count;
+    emitConstantOp(OP_JUMP_HASH, constant);
+
+    Value* values = NULL;
+    int* targets = NULL;
+    int caseCount = 0;
+    int caseCapacity = 0;
+    int* exits = NULL;
+    int exitCount = 0;
+    int exitCapacity = 0;
+    int defaultTarget = -1;
+
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        int first = caseCount;
+        if (match(TOKEN_CASE)) {
+            do {
+                int start = currentChunk()->count;
+                expression();
+                Value value = NULL_VAL;
+                if (!constantAt(start, &value) || (!IS_NUMBER(value) && !IS_STRING(value))) {
+                    error("Case value must be a number or string constant.");
+                }
+                currentChunk()->count = start;
+                if (IS_NULL(value)) continue;
+
+                // -0 and 0 are the same case
+                if (IS_NUMBER(value) && AS_NUMBER(value) == 0) value = NUMBER_VAL(0);
+                if (caseCapacity < caseCount + 1) {
+                    int oldCapacity = caseCapacity;
+                    caseCapacity = GROW_CAPACITY(oldCapacity);
+                    values = ARENA_GROW(Value, values, oldCapacity, caseCapacity);
+                    targets = ARENA_GROW(int, targets, oldCapacity, caseCapacity);
+                }
+                values[caseCount++] = value;
+            } while (match(TOKEN_COMMA));
+        } else {
+            consume(TOKEN_DEFAULT, "Expect 'case' or 'default'.");
+            if (defaultTarget != -1) error("Switch can only have one default.");
+            defaultTarget = currentChunk()->count;
+        }
+        consume(TOKEN_COLON, "Expect ':' after case.");
+
+        for (int i = first; i < caseCount; i++) {
+            targets[i] = currentChunk()->count;
+        }
+
+        beginScope();
+        while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+            declaration();
+        }
+        endScope();
+
+        if (exitCapacity < exitCount + 1) {
+            int oldCapacity = exitCapacity;
+            exitCapacity = GROW_CAPACITY(oldCapacity);
+            exits = ARENA_GROW(int, exits, oldCapacity, exitCapacity);
+        }
+        exits[exitCount++] = emitJump(OP_JUMP);
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+
+    for (int i = 0; i < exitCount; i++) {
+        patchJump(exits[i]);
+    }
+    if (defaultTarget == -1) defaultTarget = currentChunk()->count;
+
+    bool dense;
+    ObjJumpTable* table = buildJumpTable(values, targets, caseCount, defaultTarget, &dense);
+    currentChunk()->constants.values[constant] = OBJ_VAL(table);
+    if (dense) {
+        currentChunk()->code[dispatch] = (currentChunk()->code[dispatch] & OP_LONG) | OP_JUMP_TABLE;
+    }
+}
+
 static void returnStatement() {
     if (current->type == TYPE_SCRIPT) {
         error("Can't return from top-level code.");
@@ -849,6 +2314,42 @@ static void returnStatement() {
     }
 }
 
+static void throwStatement() {
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after thrown value.");
+    emitByte(OP_THROW);
+}
+
+// The protected range is only recorded in the chunk's handler table, so code
+// inside a try block runs exactly as it would without one.
+static void tryStatement() {
+    int stackDepth = current->localCount;
+    int start = currentChunk()->count;
+
+    consume(TOKEN_LEFT_BRACE, "Expect '{' after 'try'.");
+    beginScope();
+    block();
+    endScope();
+
+    int end = currentChunk()->count;
+    int exitJump = emitJump(OP_JUMP);
+    int target = currentChunk()->count;
+
+    consume(TOKEN_CATCH, "Expect 'catch' after try block.");
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'catch'.");
+    beginScope();
+    consume(TOKEN_IDENTIFIER, "Expect error variable name.");
+    declareVariable();
+    markInitialized();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after error variable.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before catch body.");
+    block();
+    endScope();
+
+    patchJump(exitJump);
+    addHandler(currentChunk(), start, end, target, stackDepth);
+}
+
 static void whileStatement() {
     int loopStart = currentChunk()->count;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
@@ -877,6 +2378,10 @@ static void synchronize() {
             case TOKEN_IF:
             case TOKEN_WHILE:
             case TOKEN_RETURN:
+            case TOKEN_TRY:
+            case TOKEN_THROW:
+            case TOKEN_SWITCH:
+            case TOKEN_CONST:
                 return;
             default:
                 ;
@@ -894,6 +2399,8 @@ static void declaration() {
         funDeclaration();
     } else if (match(TOKEN_VAR)) {
         varDeclaration();
+    } else if (match(TOKEN_CONST)) {
+        constDeclaration();
     } else {
         statement();
     }
@@ -906,10 +2413,16 @@ static void statement() {
         forStatement();
     } else if (match(TOKEN_IF)) {
         ifStatement();
+    } else if (match(TOKEN_SWITCH)) {
+        switchStatement();
     } else if (match(TOKEN_RETURN)) {
         returnStatement();
     } else if (match(TOKEN_WHILE)) {
         whileStatement();
+    } else if (match(TOKEN_TRY)) {
+        tryStatement();
+    } else if (match(TOKEN_THROW)) {
+        throwStatement();
     } else if (match(TOKEN_LEFT_BRACE)) {
         beginScope();
         block();
@@ -919,26 +2432,462 @@ static void statement() {
     }
 }
 
-ObjFunction* compile(const char* source) {
-    initScanner(source);
+// The top-level consts of a stream's piece outlive its source, so the names
+// of new ones are copied out of it
+static void keepNamedConstants() {
+    NamedConstant* kept = ALLOCATE(NamedConstant, namedConstantCount);
+    int keptCount = 0;
+    for (int i = 0; i < namedConstantCount; i++) {
+        NamedConstant constant = namedConstants[i];
+        if (constant.compiler != current || constant.depth > 0) continue;
+
+        if (constant.name.start >= parser.source && constant.name.start < parser.source + parser.sourceLength) {
+            char* name = (char*)malloc(constant.name.length);
+            memcpy(name, constant.name.start, constant.name.length);
+            constant.name.start = name;
+        }
+        kept[keptCount++] = constant;
+    }
+
+    FREE_ARRAY(NamedConstant, streamConstants, streamConstantCapacity);
+    streamConstants = kept;
+    streamConstantCount = keptCount;
+    streamConstantCapacity = namedConstantCount;
+}
+
+static void endCompile() {
+    resetArena();
+    clearInlineCandidates();
+    FREE_ARRAY(ScalarClass, scalarClasses, scalarClassCapacity);
+    scalarClasses = NULL;
+    scalarClassCount = 0;
+    scalarClassCapacity = 0;
+    FREE_ARRAY(NamedConstant, namedConstants, namedConstantCapacity);
+    namedConstants = NULL;
+    namedConstantCount = 0;
+    namedConstantCapacity = 0;
+    if (lazySource != NULL && lazySource->shadowedNatives < 0) {
+        lazySource->shadowedNatives = parser.shadowedNatives;
+    }
+    lazySource = NULL;
+}
+
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static ObjFunction* compileFile(const char* source, BodyMode bodies, bool quiet, bool stream) {
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     parser.hadError = false;
     parser.panikMode = false;
+    parser.source = source;
+    parser.sourceLength = (int)strlen(source);
+    initScanner(&parser.scanner, source, parser.sourceLength);
+    if (stream) {
+        parser.scanner.line = streamLine;
+        if (streamConstantCount > 0) {
+            namedConstantCapacity = streamConstantCount;
+            namedConstantCount = streamConstantCount;
+            namedConstants = ALLOCATE(NamedConstant, namedConstantCapacity);
+            memcpy(namedConstants, streamConstants, sizeof(NamedConstant) * namedConstantCount);
+            for (int i = 0; i < namedConstantCount; i++) namedConstants[i].compiler = current;
+        }
+    }
+    parser.shadowedNatives = -1;
+    parser.bodies = bodies;
+    parser.quiet = quiet;
+    parser.stream = stream;
+    parser.inConstant = false;
 
     advance();
     while (!match(TOKEN_EOF)) {
         declaration();
     }
+
+    // Worked out now, so the threads compiling the bodies only read it
+    if (parser.bodies == BODIES_PENDING && pendingCount > 0) nativeShadowed(0);
+    if (stream && !parser.hadError) keepNamedConstants();
     ObjFunction* function = endCompiler();
+    endCompile();
     return parser.hadError ? NULL : function;
 }
 
+// Compiles a deferred body into its function, which stays deferred if
+// there is an error
+static bool compileBody(ObjFunction* function, BodyMode bodies, bool quiet) {
+    LazyBody* body = function->lazy;
+    lazySource = body->source;
+
+    parser.hadError = false;
+    parser.panikMode = false;
+    parser.source = lazySource->chars;
+    parser.sourceLength = lazySource->length;
+    initScanner(&parser.scanner, parser.source + body->offset, parser.sourceLength - body->offset);
+    parser.scanner.line = body->line;
+    parser.shadowedNatives = lazySource->shadowedNatives;
+    parser.bodies = bodies;
+    parser.quiet = quiet;
+    parser.stream = false;
+    parser.inConstant = false;
+
+    if (body->constantCount > 0) {
+        namedConstantCapacity = body->constantCount;
+        namedConstantCount = body->constantCount;
+        namedConstants = ALLOCATE(NamedConstant, namedConstantCapacity);
+        memcpy(namedConstants, body->constants, sizeof(NamedConstant) * namedConstantCount);
+    }
+
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperclass = false;
+    classCompiler.initializer = NULL;
+    if (body->type == TYPE_METHOD) currentClass = &classCompiler;
+
+    Compiler compiler;
+    int arity = function->arity;
+    function->arity = 0;
+    initCompiler(&compiler, body->type, function);
+    advance();
+    beginScope();
+    functionBody();
+    endCompiler();
+    endCompile();
+    currentClass = NULL;
+
+    if (parser.hadError) {
+        freeChunk(&function->chunk);
+        function->arity = arity;
+    }
+    return !parser.hadError;
+}
+
+#define MAX_COMPILE_JOBS 64
+
+// A file a script loads with get("..."), compiled alongside the script.
+// get() only uses the function if the file still has the same source.
+typedef struct {
+    char* path;
+    Source source;
+    ObjFunction* function;
+} Module;
+
+static Module* modules = NULL;
+static int moduleCount = 0;
+static int moduleCapacity = 0;
+// Mentions of get or reload other than a call with the name written out,
+// which could load any file
+static int dynamicModuleCount = 0;
+
+// Either a deferred body or a module
+typedef struct {
+    ObjFunction* body;
+    Module* module;
+    bool failed;
+} CompileTask;
+
+static CompileTask* tasks = NULL;
+static int taskCount = 0;
+static atomic_int nextTask;
+
+static void findModules(const char* source);
+
+static void addModule(const char* start, int length) {
+    for (int i = 0; i < moduleCount; i++) {
+        if ((int)strlen(modules[i].path) == length && memcmp(modules[i].path, start, length) == 0) return;
+    }
+
+    char* path = (char*)malloc(length + 1);
+    memcpy(path, start, length);
+    path[length] = '\0';
+
+    // A missing file is left for get() to report when it runs
+    Source source;
+    if (!openSource(&source, path, false)) {
+        free(path);
+        dynamicModuleCount++;
+        return;
+    }
+
+    if (moduleCapacity < moduleCount + 1) {
+        int oldCapacity = moduleCapacity;
+        moduleCapacity = GROW_CAPACITY(oldCapacity);
+        modules = GROW_ARRAY(Module, modules, oldCapacity, moduleCapacity);
+    }
+
+    Module* module = &modules[moduleCount++];
+    module->path = path;
+    module->source = source;
+    module->function = NULL;
+    findModules(source.chars);
+}
+
+static bool isLoader(Token* token) {
+    return token->type == TOKEN_IDENTIFIER &&
+        ((token->length == 3 && memcmp(token->start, "get", 3) == 0) ||
+         (token->length == 6 && memcmp(token->start, "reload", 6) == 0));
+}
+
+// Calls like get("file") or reload("file") with the name written out
+static void findModules(const char* source) {
+    Scanner scanner;
+    initScanner(&scanner, source, (int)strlen(source));
+
+    Token tokens[3];
+    for (int i = 0; i < 3; i++) tokens[i].type = TOKEN_EOF;
+
+    for (Token token = scanToken(&scanner); token.type != TOKEN_EOF; token = scanToken(&scanner)) {
+        if (isLoader(&tokens[0])) {
+            if (token.type == TOKEN_RIGHT_PAREN && tokens[2].type == TOKEN_STRING &&
+                tokens[1].type == TOKEN_LEFT_PAREN) {
+                addModule(tokens[2].start + 1, tokens[2].length - 2);
+            } else {
+                dynamicModuleCount++;
+            }
+        }
+        tokens[0] = tokens[1];
+        tokens[1] = tokens[2];
+        tokens[2] = token;
+    }
+}
+
+static DWORD WINAPI compileWorker(LPVOID unused) {
+    for (;;) {
+        int index = atomic_fetch_add(&nextTask, 1);
+        if (index >= taskCount) {
+            freeArena();
+            return 0;
+        }
+
+        CompileTask* task = &tasks[index];
+        if (task->body != NULL) {
+            task->failed = !compileBody(task->body, BODIES_WHOLE, true);
+        } else if (task->module != NULL) {
+            task->module->function = compileFile(task->module->source.chars, BODIES_WHOLE, true, false);
+        }
+    }
+}
+
+// Compiles the bodies compileFile() left behind and the modules the source
+// names on up to compileJobs threads, this one included. If anything fails,
+// the whole file is compiled again on this thread to report the errors.
+static ObjFunction* compileInParallel(ObjFunction* function, const char* source, BodyMode bodies) {
+    int firstModule = moduleCount;
+    if (function != NULL) findModules(source);
+
+    taskCount = pendingCount + moduleCount - firstModule;
+    tasks = ALLOCATE(CompileTask, taskCount);
+    for (int i = 0; i < pendingCount; i++) {
+        tasks[i].body = pendingBodies[i];
+        tasks[i].module = NULL;
+        tasks[i].failed = false;
+    }
+    for (int i = firstModule; i < moduleCount; i++) {
+        CompileTask* task = &tasks[pendingCount + i - firstModule];
+        task->body = NULL;
+        task->module = &modules[i];
+        task->failed = false;
+
+        // With --cache, a module is loaded here if it can be, and saved
+        // below once a thread has compiled it
+        if (cacheDirectory != NULL && function != NULL) {
+            modules[i].function = loadCache(modules[i].source.chars, modules[i].source.length);
+            if (modules[i].function != NULL) {
+                cachedCount++;
+                task->module = NULL;
+            }
+        }
+    }
+
+    if (function != NULL) {
+        HANDLE threads[MAX_COMPILE_JOBS];
+        int threadCount = (compileJobs < taskCount ? compileJobs : taskCount) - 1;
+        atomic_store(&nextTask, 0);
+        shareHeap(true);
+        for (int i = 0; i < threadCount; i++) {
+            threads[i] = CreateThread(NULL, 0, compileWorker, NULL, 0, NULL);
+            if (threads[i] == NULL) threadCount = i;
+        }
+        compileWorker(NULL);
+        for (int i = 0; i < threadCount; i++) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+        shareHeap(false);
+    }
+
+    bool failed = function == NULL;
+    for (int i = 0; i < pendingCount; i++) {
+        if (tasks[i].failed) {
+            failed = true;
+        } else if (function != NULL) {
+            LazyBody* body = pendingBodies[i]->lazy;
+            pendingBodies[i]->lazy = NULL;
+            freeLazyBody(body);
+        }
+    }
+    for (int i = firstModule; i < moduleCount; i++) {
+        if (modules[i].function == NULL) {
+            closeSource(&modules[i].source);
+        } else if (cacheDirectory != NULL && tasks[pendingCount + i - firstModule].module != NULL) {
+            saveCache(modules[i].source.chars, modules[i].source.length, modules[i].function);
+        }
+    }
+
+    FREE_ARRAY(CompileTask, tasks, taskCount);
+    tasks = NULL;
+    taskCount = 0;
+    FREE_ARRAY(ObjFunction*, pendingBodies, pendingCapacity);
+    pendingBodies = NULL;
+    pendingCount = 0;
+    pendingCapacity = 0;
+
+    return failed ? compileFile(source, bodies, false, false) : function;
+}
+
+ObjFunction* compile(const char* source) {
+    double start = now();
+    bool stream = streamCompile;
+    streamCompile = false;
+    // Stream pieces depend on what came before them, and --debug wants to
+    // print what it compiles
+    bool cached = cacheDirectory != NULL && !stream && !debug;
+    int length = cached ? (int)strlen(source) : 0;
+    bool parallel = compileJobs > 1 && !debug && !stream;
+    pauseCollection();
+    ObjFunction* function = cached ? loadCache(source, length) : NULL;
+    if (function != NULL) {
+        cachedCount++;
+    } else {
+        // Bodies left for later couldn't be saved, so a cached file is
+        // compiled whole once instead, on the threads of --jobs if it can be
+        BodyMode bodies = lazyCompile && !stream && !cached ? BODIES_LAZY : BODIES_WHOLE;
+        function = compileFile(source, parallel && bodies == BODIES_WHOLE ? BODIES_PENDING : bodies, parallel, stream);
+        if (parallel) function = compileInParallel(function, source, bodies);
+        if (cached && function != NULL) saveCache(source, length, function);
+    }
+    resumeCollection();
+    compileSeconds += now() - start;
+    return function;
+}
+
+// Compiles a body skipped by --lazy. Errors are reported now rather than
+// before the script ran, and the next call reports them again.
+bool compileLazy(ObjFunction* function) {
+    double start = now();
+    pauseCollection();
+    bool compiled = compileBody(function, BODIES_LAZY, false);
+    resumeCollection();
+    if (compiled) {
+        LazyBody* body = function->lazy;
+        function->lazy = NULL;
+        freeLazyBody(body);
+        lazyCount++;
+    }
+    lazySeconds += now() - start;
+    return compiled;
+}
+
+// For --link: compiles the script and every file it loads with a written
+// out get("...") name, each one whole, takes out the defs none of them use
+// and writes them all to one image. If the script can get() any other file,
+// that file might use any def, so they all stay.
+bool linkScript(const char* source, const char* output) {
+    pauseCollection();
+    dynamicModuleCount = 0;
+    ObjFunction* script = compileFile(source, BODIES_WHOLE, false, false);
+    bool linked = script != NULL;
+    if (linked) findModules(source);
+
+    ObjFunction** functions = ALLOCATE(ObjFunction*, moduleCount + 1);
+    const char** paths = ALLOCATE(const char*, moduleCount);
+    functions[0] = script;
+    for (int i = 0; i < moduleCount && linked; i++) {
+        functions[i + 1] = compileFile(modules[i].source.chars, BODIES_WHOLE, false, false);
+        paths[i] = modules[i].path;
+        if (functions[i + 1] == NULL) {
+            fprintf(stderr, "Error: Could not compile \"%s\".\n", modules[i].path);
+            linked = false;
+        }
+    }
+
+    if (linked) {
+        int dropped = dynamicModuleCount == 0 ? dropUnusedDefinitions(functions, moduleCount + 1) : 0;
+        linked = writeImage(output, script, paths, functions + 1, moduleCount);
+        if (linked) {
+            printf("\033[0;33m");
+            printf("Linked %d files into \"%s\" and dropped %d unused definitions\n", moduleCount + 1, output, dropped);
+            printf("\033[0m");
+        } else {
+            fprintf(stderr, "Error: Could not write \"%s\".\n", output);
+        }
+    }
+
+    FREE_ARRAY(ObjFunction*, functions, moduleCount + 1);
+    FREE_ARRAY(const char*, paths, moduleCount);
+    for (int i = 0; i < moduleCount; i++) {
+        closeSource(&modules[i].source);
+        free(modules[i].path);
+    }
+    FREE_ARRAY(Module, modules, moduleCapacity);
+    modules = NULL;
+    moduleCount = 0;
+    moduleCapacity = 0;
+    resumeCollection();
+    return linked;
+}
+
+// The function compiled ahead for a file get() loads, if the file hasn't
+// changed since. Each one is used once.
+ObjFunction* takeModule(const char* path, const char* source) {
+    for (int i = 0; i < moduleCount; i++) {
+        if (modules[i].function == NULL || strcmp(modules[i].path, path) != 0) continue;
+
+        ObjFunction* function = strcmp(modules[i].source.chars, source) == 0 ? modules[i].function : NULL;
+        modules[i].function = NULL;
+        closeSource(&modules[i].source);
+        return function;
+    }
+
+    return NULL;
+}
+
+void markLazyBody(LazyBody* body) {
+    for (int i = 0; i < body->constantCount; i++) {
+        markValue(body->constants[i].value);
+    }
+}
+
+void freeLazyBody(LazyBody* body) {
+    if (--body->source->refs == 0) {
+        FREE_ARRAY(char, body->source->chars, body->source->length + 1);
+        FREE(LazySource, body->source);
+    }
+    FREE_ARRAY(NamedConstant, body->constants, body->constantCount);
+    FREE(LazyBody, body);
+}
+
+void printCompileTime() {
+    printf("\033[0;33m");
+    printf("Compiling took %.3f ms, with %d function bodies deferred\n", compileSeconds * 1000, deferredCount);
+    if (lazyCount > 0) {
+        printf("Compiled %d deferred bodies in %.3f ms on their first call\n", lazyCount, lazySeconds * 1000);
+    }
+    if (cachedCount > 0) {
+        printf("Loaded %d files from the bytecode cache\n", cachedCount);
+    }
+    printf("\033[0m");
+}
+
 void markCompilerRoots() {
-    Compiler* compiler = current;
-    while (compiler != NULL) {
-        markObject((Obj*)compiler->function);
-        compiler = compiler->enclosing;
+    for (int i = 0; i < moduleCount; i++) {
+        markObject((Obj*)modules[i].function);
+    }
+
+    for (int i = 0; i < streamConstantCount; i++) {
+        markValue(streamConstants[i].value);
     }
 }
\ No newline at end of file
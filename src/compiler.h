@@ -4,7 +4,18 @@
 #include "object.h"
 #include "vm.h"
 
+extern bool lazyCompile;
+extern int compileJobs;
+extern bool streamCompile;
+extern int streamLine;
+
 ObjFunction* compile(const char* source);
+bool compileLazy(ObjFunction* function);
+ObjFunction* takeModule(const char* path, const char* source);
+bool linkScript(const char* source, const char* output);
+void markLazyBody(LazyBody* body);
+void freeLazyBody(LazyBody* body);
 void markCompilerRoots();
+void printCompileTime();
 
 #endif
\ No newline at end of file
@@ -11,31 +11,68 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     for (int offset = 0; offset < chunk->count;) {
         offset = disassembleInstruction(chunk, offset);
     }
+
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        printf("\033[0;33m");
+        printf("try %04d-%04d", handler->start, handler->end);
+        printf("\033[0;31m");
+        printf(" -> %04d (depth %d)\n", handler->target, handler->stackDepth);
+        printf("\033[0m");
+    }
+}
+
+// Set while printing the long form of an instruction, where constant
+// indexes and jumps take three bytes
+static bool longForm = false;
+
+static int readIndex(Chunk* chunk, int* offset) {
+    int index = chunk->code[(*offset)++];
+    if (longForm) {
+        index = (index << 8) | chunk->code[(*offset)++];
+        index = (index << 8) | chunk->code[(*offset)++];
+    }
+    return index;
+}
+
+static int readJump(Chunk* chunk, int* offset) {
+    int jump = (chunk->code[*offset] << 8) | chunk->code[*offset + 1];
+    *offset += 2;
+    if (longForm) jump = (jump << 8) | chunk->code[(*offset)++];
+    return jump;
+}
+
+static void printName(const char* name) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%s%s", name, longForm ? "_LONG" : "");
+    printf("%-16s", buffer);
 }
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     printf("\033[0;36m");
-    uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s", name);
+    offset++;
+    int constant = readIndex(chunk, &offset);
+    printName(name);
     printf("\033[0;31m");
     printf(" %4d '", constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
     printf("\033[0m");
-    return offset + 2;
+    return offset;
 }
 
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     printf("\033[0;36m");
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
-    printf("%-16s", name);
+    offset++;
+    int constant = readIndex(chunk, &offset);
+    uint8_t argCount = chunk->code[offset++];
+    printName(name);
     printf("\033[0;31m");
     printf(" (%d args) %4d '", argCount, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
     printf("\033[0m");
-    return offset + 3;
+    return offset;
 }
 
 static int simpleInstruction(const char* name, int offset) {
@@ -47,39 +84,164 @@ static int simpleInstruction(const char* name, int offset) {
 
 static int variableInstruction(const char* name, Chunk* chunk, int offset) {
     printf("\033[0;36m");
-    uint8_t varSlotOrConstant = chunk->code[offset + 1];
-    uint8_t isSet = chunk->code[offset + 2];
+    offset++;
+    bool isGlobal = strcmp(name, "OP_GLOBAL") == 0;
+    int varSlotOrConstant = isGlobal ? readIndex(chunk, &offset) : chunk->code[offset++];
+    uint8_t isSet = chunk->code[offset++];
     
-    printf("%-16s", name);
+    printName(name);
     printf("\033[0;31m");
     printf(" %4d ", varSlotOrConstant);
-    printf(isSet ? "SET: '" : "GET: '");
+    printf(isSet == SET_AND_POP ? "SET & POP: '" : isSet ? "SET: '" : "GET: '");
     
-    if (strcmp(name, "OP_GLOBAL") == 0) {
+    if (isGlobal) {
         printValue(chunk->constants.values[varSlotOrConstant]);
     } else {
         printf("%d", varSlotOrConstant);
     }
     printf("'\n");
     printf("\033[0m");
-    return offset + 3;
+    return offset;
 }
 
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     printf("\033[0;36m");
-    int16_t jump = (int16_t)(chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
-    printf("%-16s", name);
+    int start = offset++;
+    int jump = readJump(chunk, &offset);
+    printName(name);
     printf("\033[0;31m");
-    printf(" %4d -> %d\n", offset, offset + 3 + sign * jump);
+    printf(" %4d -> %d\n", start, offset + sign * jump);
     printf("\033[0m");
-    return offset + 3;
+    return offset;
+}
+
+static int forInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    printf("\033[0;36m");
+    offset++;
+    uint8_t slot = chunk->code[offset++];
+    uint8_t mode = chunk->code[offset++];
+    int limit = readIndex(chunk, &offset);
+    int step = sign < 0 ? readIndex(chunk, &offset) : -1;
+    int jump = readJump(chunk, &offset);
+    printName(name);
+    printf("\033[0;31m");
+    printf(" %4d %s ", slot, mode & FOR_INCLUSIVE ? "<=" : "<");
+    if (mode & FOR_CONSTANT_LIMIT) {
+        printValue(chunk->constants.values[limit]);
+    } else {
+        printf("%d", limit);
+    }
+    if (step != -1) {
+        printf(" step ");
+        printValue(chunk->constants.values[step]);
+    }
+    printf(" -> %d\n", offset + sign * jump);
+    printf("\033[0m");
+    return offset;
+}
+
+static int scalarInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t field = chunk->code[offset + 2];
+    offset += 3;
+    int constant = readIndex(chunk, &offset);
+    printf("\033[0;36m");
+    printName(name);
+    printf("\033[0;31m");
+    printf(" %4d %4d '", slot, field);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    printf("\033[0m");
+    return offset;
+}
+
+static int inlineGuardInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("\033[0;36m");
+    offset++;
+    int method = strcmp(name, "OP_INLINE_INVOKE_GUARD") == 0 ? readIndex(chunk, &offset) : -1;
+    uint8_t argCount = chunk->code[offset++];
+    int function = readIndex(chunk, &offset);
+    int jump = readJump(chunk, &offset);
+    printName(name);
+    printf("\033[0;31m");
+    printf(" %4d ", argCount);
+    if (method != -1) {
+        printValue(chunk->constants.values[method]);
+        printf(" ");
+    }
+    printValue(chunk->constants.values[function]);
+    printf(" else call -> %d\n", offset + jump);
+    printf("\033[0m");
+    return offset;
+}
+
+static int nativeGuardInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("\033[0;36m");
+    offset++;
+    int native = readIndex(chunk, &offset);
+    int result = readIndex(chunk, &offset);
+    int jump = readJump(chunk, &offset);
+    printName(name);
+    printf("\033[0;31m");
+    printf(" '");
+    printValue(chunk->constants.values[native]);
+    printf("' is ");
+    printValue(chunk->constants.values[result]);
+    printf(" -> %d\n", offset + jump);
+    printf("\033[0m");
+    return offset;
+}
+
+static int compoundInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("\033[0;36m");
+    offset++;
+    bool isSlot = strstr(name, "LOCAL") != NULL || strstr(name, "UPVALUE") != NULL;
+    int target = isSlot ? chunk->code[offset++] : readIndex(chunk, &offset);
+    int operand = readIndex(chunk, &offset);
+    uint8_t isSet = chunk->code[offset++];
+    printName(name);
+    printf("\033[0;31m");
+    printf(" %4d '", target);
+    if (isSlot) {
+        printf("%d", target);
+    } else {
+        printValue(chunk->constants.values[target]);
+    }
+    printf("' ");
+    printValue(chunk->constants.values[operand]);
+    printf(isSet == SET_AND_POP ? " SET & POP\n" : isSet == POSTFIX ? " SET & KEEP OLD\n" : " SET\n");
+    printf("\033[0m");
+    return offset;
+}
+
+static int jumpTableInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("\033[0;36m");
+    offset++;
+    int constant = readIndex(chunk, &offset);
+    ObjJumpTable* table = AS_JUMP_TABLE(chunk->constants.values[constant]);
+    printName(name);
+    printf("\033[0;31m");
+    printf(" %4d", constant);
+    for (int i = 0; i < table->count; i++) {
+        if (table->keys != NULL) {
+            if (IS_NULL(table->keys[i])) continue;
+            printf(" ");
+            printValue(table->keys[i]);
+        } else {
+            if (table->targets[i] == table->targets[table->count]) continue;
+            printf(" %g", table->low + i);
+        }
+        printf(" -> %d", table->targets[i]);
+    }
+    printf(" default -> %d\n", table->targets[table->count]);
+    printf("\033[0m");
+    return offset;
 }
 
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     printf("\033[0;36m");
     uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s", name);
+    printName(name);
     printf("\033[0;31m");
     printf(" %4d\n", slot);
     printf("\033[0m");
@@ -90,20 +252,24 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     printf("\033[0;35m");
     printf("%04d ", offset);
     printf("\033[0;36m");
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
     
     uint8_t instruction = chunk->code[offset];
-    switch (instruction) {
+    longForm = (instruction & OP_LONG) != 0;
+    switch (instruction & ~OP_LONG) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
         case OP_BOOL:
             return constantInstruction("OP_BOOL", chunk, offset);
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
+        case OP_DUP:
+            return simpleInstruction("OP_DUP", offset);
         case OP_LOCAL:
             return variableInstruction("OP_LOCAL", chunk, offset);
         case OP_GLOBAL:
@@ -122,12 +288,46 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_BINARY", chunk, offset);
         case OP_COMPARE:
             return constantInstruction("OP_COMPARE", chunk, offset);
+        case OP_COMPARE_NOT:
+            return constantInstruction("OP_COMPARE_NOT", chunk, offset);
         case OP_UNARY:
             return simpleInstruction("OP_UNARY", offset);
+        case OP_MODULO:
+            return simpleInstruction("OP_MODULO", offset);
+        case OP_FLOOR_DIVIDE:
+            return simpleInstruction("OP_FLOOR_DIVIDE", offset);
+        case OP_POWER:
+            return simpleInstruction("OP_POWER", offset);
+        case OP_BIT_AND:
+            return simpleInstruction("OP_BIT_AND", offset);
+        case OP_BIT_OR:
+            return simpleInstruction("OP_BIT_OR", offset);
+        case OP_BIT_XOR:
+            return simpleInstruction("OP_BIT_XOR", offset);
+        case OP_SHIFT_LEFT:
+            return simpleInstruction("OP_SHIFT_LEFT", offset);
+        case OP_SHIFT_RIGHT:
+            return simpleInstruction("OP_SHIFT_RIGHT", offset);
+        case OP_BUILD_STRING:
+            return byteInstruction("OP_BUILD_STRING", chunk, offset);
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE:
+            return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LOOP:
+            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_JUMP_TABLE:
+            return jumpTableInstruction("OP_JUMP_TABLE", chunk, offset);
+        case OP_JUMP_HASH:
+            return jumpTableInstruction("OP_JUMP_HASH", chunk, offset);
+        case OP_FOR_LOOP:
+            return forInstruction("OP_FOR_LOOP", 1, chunk, offset);
+        case OP_FOR_STEP:
+            return forInstruction("OP_FOR_STEP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
         case OP_INVOKE:
@@ -136,9 +336,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
             offset++;
-            uint8_t constant = chunk->code[offset++];
+            int constant = readIndex(chunk, &offset);
             printf("\033[0;36m");
-            printf("%-16s ", "OP_CLOSURE");
+            printName("OP_CLOSURE");
+            printf(" ");
             printf("\033[0;31m");
             printf("%4d ", constant);
             printValue(chunk->constants.values[constant]);
@@ -164,6 +365,47 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_THROW:
+            return simpleInstruction("OP_THROW", offset);
+        case OP_INLINE_GUARD:
+            return inlineGuardInstruction("OP_INLINE_GUARD", chunk, offset);
+        case OP_INLINE_INVOKE_GUARD:
+            return inlineGuardInstruction("OP_INLINE_INVOKE_GUARD", chunk, offset);
+        case OP_INLINE_EXIT:
+            return byteInstruction("OP_INLINE_EXIT", chunk, offset);
+        case OP_NATIVE_GUARD:
+            return nativeGuardInstruction("OP_NATIVE_GUARD", chunk, offset);
+        case OP_SCALAR_NEW: {
+            uint8_t argCount = chunk->code[offset + 1];
+            uint8_t extraCount = chunk->code[offset + 2];
+            offset += 3;
+            int function = readIndex(chunk, &offset);
+            int jump = readJump(chunk, &offset);
+            printf("\033[0;36m");
+            printName("OP_SCALAR_NEW");
+            printf("\033[0;31m");
+            printf(" %4d %d ", argCount, extraCount);
+            printValue(chunk->constants.values[function]);
+            printf(" -> %d\n", offset + jump);
+            printf("\033[0m");
+            return offset;
+        }
+        case OP_SCALAR_GET:
+            return scalarInstruction("OP_SCALAR_GET", chunk, offset);
+        case OP_SCALAR_SET:
+            return scalarInstruction("OP_SCALAR_SET", chunk, offset);
+        case OP_ADD_LOCAL_CONST:
+            return compoundInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+        case OP_ADD_UPVALUE_CONST:
+            return compoundInstruction("OP_ADD_UPVALUE_CONST", chunk, offset);
+        case OP_COMPOUND_LOCAL:
+            return compoundInstruction("OP_COMPOUND_LOCAL", chunk, offset);
+        case OP_COMPOUND_UPVALUE:
+            return compoundInstruction("OP_COMPOUND_UPVALUE", chunk, offset);
+        case OP_COMPOUND_GLOBAL:
+            return compoundInstruction("OP_COMPOUND_GLOBAL", chunk, offset);
+        case OP_COMPOUND_PROPERTY:
+            return compoundInstruction("OP_COMPOUND_PROPERTY", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
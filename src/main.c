@@ -1,13 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <windows.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
 #include "vm.h"
 #include "native.h"
+#include "optimizer.h"
+#include "scanner.h"
+#include "source.h"
 
 bool debug = false;
+static bool compileTime = false;
+static bool scanSpeed = false;
 
 static void repl() {
     char line[1024];
@@ -17,28 +27,281 @@ static void repl() {
             printf("\n");
             break;
         }
-        interpret(line);
+        streamCompile = true;
+        if (interpret(line) != INTERPRET_COMPILE_ERROR) printf("\033[0m");
     }
 }
 
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Scans the whole file over and over for about a second
+static void printScanSpeed(const char* source) {
+    int length = (int)strlen(source);
+    long tokens = 0;
+    int passes = 0;
+    double start = now();
+    double seconds;
+    do {
+        Scanner scanner;
+        initScanner(&scanner, source, length);
+        for (Token token = scanToken(&scanner); token.type != TOKEN_EOF; token = scanToken(&scanner)) {
+            tokens++;
+        }
+        passes++;
+        seconds = now() - start;
+    } while (seconds < 1);
+
+    double megabytes = (double)length * passes / (1024 * 1024);
+    printf("\033[0;33m");
+    printf("Scanned %.2f MB in %.3f s: %.1f MB/s, %.1f million tokens/s\n",
+           megabytes, seconds, megabytes / seconds, tokens / seconds / 1e6);
+    printf("\033[0m");
+}
+
+// A script read from stdin or a pipe. buffer holds what has been read but
+// not run yet, and the scanner is left after its last whole token.
+typedef struct {
+    FILE* file;
+    char* buffer;
+    int length;
+    int capacity;
+    Scanner scanner;
+} Stream;
+
+static void moveScanner(Stream* stream, char* buffer, int shift) {
+    stream->scanner.start = buffer + (stream->scanner.start - stream->buffer) - shift;
+    stream->scanner.current = buffer + (stream->scanner.current - stream->buffer) - shift;
+    stream->buffer = buffer;
+    stream->scanner.end = buffer + stream->length;
+}
+
+// Appends the next line. Whole lines are read, so only a string can be cut
+// off at the end of the buffer.
+static bool readLine(Stream* stream) {
+    int start = stream->length;
+    for (;;) {
+        if (stream->capacity - stream->length < 2) {
+            stream->capacity *= 2;
+            char* buffer = (char*)malloc(stream->capacity);
+            if (buffer == NULL) {
+                fprintf(stderr, "Error: Not enough memory to read the script.\n");
+                exit(74);
+            }
+            char* old = stream->buffer;
+            memcpy(buffer, old, stream->length + 1);
+            moveScanner(stream, buffer, 0);
+            free(old);
+        }
+
+        char* line = stream->buffer + stream->length;
+        if (fgets(line, stream->capacity - stream->length, stream->file) == NULL) break;
+        stream->length += (int)strlen(line);
+        if (stream->buffer[stream->length - 1] == '\n') break;
+    }
+
+    stream->scanner.end = stream->buffer + stream->length;
+    return stream->length > start;
+}
+
+// Runs the first length chars of the buffer and drops them
+static InterpretResult runPiece(Stream* stream, int length, int line) {
+    char next = stream->buffer[length];
+    stream->buffer[length] = '\0';
+    streamCompile = true;
+    streamLine = line;
+    InterpretResult result = interpret(stream->buffer);
+    stream->buffer[length] = next;
+
+    stream->length -= length;
+    memmove(stream->buffer, stream->buffer + length, stream->length + 1);
+    moveScanner(stream, stream->buffer, length);
+    return result;
+}
+
+// Runs each top-level declaration as soon as the next token shows it is
+// complete, so only the one being read is held in memory. A declaration
+// ends with a ; or } outside any brackets, unless else or catch follows.
+static InterpretResult runStream(FILE* file) {
+    Stream stream;
+    stream.file = file;
+    stream.length = 0;
+    stream.capacity = 4096;
+    stream.buffer = (char*)malloc(stream.capacity);
+    stream.buffer[0] = '\0';
+    initScanner(&stream.scanner, stream.buffer, 0);
+
+    InterpretResult result = INTERPRET_OK;
+    int depth = 0;
+    int pieceLine = 1;
+    int pieceEnd = 0;
+    int endLine = 1;
+    bool pending = false;
+    bool more = true;
+    while (more && result == INTERPRET_OK) {
+        more = readLine(&stream);
+        for (;;) {
+            Scanner before = stream.scanner;
+            Token token = scanToken(&stream.scanner);
+            if (token.type == TOKEN_EOF ||
+                (token.type == TOKEN_ERROR && more && stream.scanner.current == stream.scanner.end)) {
+                stream.scanner = before;
+                break;
+            }
+
+            if (pieceEnd > 0 && token.type != TOKEN_ELSE && token.type != TOKEN_CATCH) {
+                result = runPiece(&stream, pieceEnd, pieceLine);
+                if (result != INTERPRET_OK) break;
+                pieceLine = endLine;
+            }
+            pieceEnd = 0;
+            pending = true;
+
+            if (token.type == TOKEN_LEFT_PAREN || token.type == TOKEN_LEFT_BRACE) depth++;
+            if ((token.type == TOKEN_RIGHT_PAREN || token.type == TOKEN_RIGHT_BRACE) && depth > 0) depth--;
+            if (depth == 0 && (token.type == TOKEN_SEMICOLON || token.type == TOKEN_RIGHT_BRACE)) {
+                pieceEnd = (int)(stream.scanner.current - stream.buffer);
+                endLine = token.line;
+            }
+        }
+    }
+
+    if (result == INTERPRET_OK && pending) result = runPiece(&stream, stream.length, pieceLine);
+    free(stream.buffer);
+    return result;
+}
+
+static void finishRun(InterpretResult result) {
+    // Once the script has run, not after each piece of a stream
+    if (result != INTERPRET_COMPILE_ERROR) printf("\033[0m");
+    if (compileTime) printCompileTime();
+
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_TIMEOUT) exit(75);
+    clsArray();
+}
+
+// An image from --link holds the script and every file it loads, compiled
+static void runImage(const char* path) {
+    ObjFunction* function = loadImage(path);
+    if (function == NULL) {
+        fprintf(stderr, "Error: \"%s\" is not an image this version of nppc3 can run.\n", path);
+        exit(65);
+    }
+    finishRun(interpretFunction(function));
+}
+
 static void runMain(const char* path) {
-    if (!hasSuffix(path, ".npp")) {
+    if (hasSuffix(path, ".nppimg")) {
+        runImage(path);
+        return;
+    }
+
+    if (!hasSuffix(path, ".npp") && strcmp(path, "-") != 0) {
         fprintf(stderr, "Error: The file \"%s\" does not have the required \".npp\" extension.\n", path);
         exit(74);
     }
 
-    char* source = readFile(path);
-    if (source == NULL) {
+    Source source;
+    if (strcmp(path, "-") == 0) {
+        source.kind = SOURCE_STREAM;
+        source.stream = stdin;
+    } else if (!openSource(&source, path, !scanSpeed)) {
         fprintf(stderr, "Error: Unable to read the file \"%s\".\n", path);
         exit(66); // File read error
     }
 
-    InterpretResult result = interpret(source);
-    free(source);
+    if (scanSpeed) {
+        if (source.kind == SOURCE_STREAM) {
+            fprintf(stderr, "Error: \"--scan-speed\" needs a file, not a stream.\n");
+            exit(64);
+        }
+        printScanSpeed(source.chars);
+        closeSource(&source);
+        return;
+    }
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
-    clsArray();
+    InterpretResult result;
+    if (source.kind == SOURCE_STREAM) {
+        result = runStream(source.stream);
+        if (source.stream != stdin) closeSource(&source);
+    } else {
+        result = interpret(source.chars);
+        closeSource(&source);
+    }
+    finishRun(result);
+}
+
+static void linkMain(const char* path, const char* output) {
+    Source source;
+    if (!openSource(&source, path, false)) {
+        fprintf(stderr, "Error: Unable to read the file \"%s\".\n", path);
+        exit(66);
+    }
+
+    bool linked = linkScript(source.chars, output);
+    closeSource(&source);
+    if (!linked) exit(65);
+}
+
+static DWORD WINAPI watchdog(LPVOID milliseconds) {
+    Sleep((DWORD)(uintptr_t)milliseconds);
+    interruptVM();
+    return 0;
+}
+
+static void startWatchdog(long milliseconds) {
+    HANDLE thread = CreateThread(NULL, 0, watchdog, (LPVOID)(uintptr_t)milliseconds, 0, NULL);
+    if (thread == NULL) {
+        fprintf(stderr, "Error: Could not start the watchdog thread.\n");
+        exit(71);
+    }
+    CloseHandle(thread);
+}
+
+// Accepts a plain byte count or one with a K, M or G suffix
+static size_t sizeOption(int argc, const char* argv[], int* i) {
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Error: Option \"%s\" expects a size.\n", argv[*i]);
+        exit(64);
+    }
+
+    char* end;
+    const char* text = argv[++*i];
+    double value = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; end++; break;
+        case 'm': case 'M': value *= 1024 * 1024; end++; break;
+        case 'g': case 'G': value *= 1024 * 1024 * 1024; end++; break;
+    }
+
+    if (end == text || *end != '\0' || value < 1) {
+        fprintf(stderr, "Error: \"%s\" is not a valid size for \"%s\".\n", text, argv[*i - 1]);
+        exit(64);
+    }
+
+    return (size_t)value;
+}
+
+static long numberOption(int argc, const char* argv[], int* i) {
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Error: Option \"%s\" expects a number.\n", argv[*i]);
+        exit(64);
+    }
+
+    char* end;
+    const char* text = argv[++*i];
+    long long value = strtoll(text, &end, 10);
+    if (end == text || *end != '\0' || value < 0) {
+        fprintf(stderr, "Error: \"%s\" is not a valid number for \"%s\".\n", text, argv[*i - 1]);
+        exit(64);
+    }
+
+    return (long)value;
 }
 
 int main(int argc, const char* argv[]) {
@@ -46,29 +309,89 @@ int main(int argc, const char* argv[]) {
     const char* suffix = ".npp";
 
     if (argc == 2 && strcmp(argv[1], "help") == 0) {
-        printf("Usage: nppc3 [main_file] // [args...]\n");
+        printf("Usage: nppc3 [main_file] [options...] // [args...]\n");
+        printf("       nppc3 - [options...] // [args...] to read the script from stdin\n");
+        printf("       nppc3 --link main_file -o image.nppimg [-O0|-O1|-O2] to link it and every get(\"...\") file\n");
+        printf("       nppc3 image.nppimg [options...] // [args...] to run a linked image\n");
+        printf("Options:\n");
+        printf("  --debug         Print bytecode and allocations\n");
+        printf("  -O0, -O1, -O2   Choose how much the bytecode is optimized (default -O1)\n");
+        printf("  --budget N      Stop after about N bytecode bytes of loops and calls\n");
+        printf("  --timeout MS    Stop after MS milliseconds\n");
+        printf("  --max-heap SIZE Throw \"Out of memory.\" above SIZE bytes (K, M and G work)\n");
+        printf("  --lazy          Compile each function body on its first call\n");
+        printf("  --compile-time  Print how long compiling took\n");
+        printf("  --jobs N        Compile function bodies and get() files on N threads\n");
+        printf("  --scan-speed    Time the scanner on the file in MB/s instead of running it\n");
+        printf("  --cache DIR     Keep compiled bytecode in DIR and reuse it while the source is unchanged\n");
         exit(0);
     } else if (argc == 1) {
         repl();
-    } else if (argc == 2 && hasSuffix(argv[1], suffix)) {
-        runMain(argv[1]);
-    } else if (argc >= 3 && hasSuffix(argv[1], suffix)) {
-        if (strcmp(argv[2], "//") == 0) {
-            int argsCount = argc - 3;
-            const char** args = &argv[3];
-            init(args, argsCount);
-            runMain(argv[1]);
-        } else if (strcmp(argv[2], "--debug") == 0) {
-            debug = true;
-            if (argc > 3 && strcmp(argv[3], "//") == 0) {
-                int argsCount = argc - 4;
-                const char** args = &argv[4];
-                init(args, argsCount);
-                runMain(argv[1]);
+    } else if (strcmp(argv[1], "--link") == 0) {
+        if (argc < 3 || !hasSuffix(argv[2], suffix)) {
+            fprintf(stderr, "Error: \"--link\" expects a \".npp\" file.\n");
+            exit(64);
+        }
+
+        const char* output = NULL;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                output = argv[++i];
+            } else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0) {
+                optimizationLevel = argv[i][2] - '0';
+            } else {
+                fprintf(stderr, "Error: Unknown option \"%s\".\n", argv[i]);
+                exit(64);
+            }
+        }
+        if (output == NULL) {
+            fprintf(stderr, "Error: \"--link\" expects \"-o image.nppimg\".\n");
+            exit(64);
+        }
+
+        linkMain(argv[2], output);
+    } else if (hasSuffix(argv[1], suffix) || hasSuffix(argv[1], ".nppimg") || strcmp(argv[1], "-") == 0) {
+        long timeout = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "//") == 0) {
+                init(&argv[i + 1], argc - i - 1);
+                break;
+            } else if (strcmp(argv[i], "--debug") == 0) {
+                debug = true;
+            } else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0) {
+                optimizationLevel = argv[i][2] - '0';
+            } else if (strcmp(argv[i], "--budget") == 0) {
+                setInstructionBudget(numberOption(argc, argv, &i));
+            } else if (strcmp(argv[i], "--timeout") == 0) {
+                timeout = numberOption(argc, argv, &i);
+            } else if (strcmp(argv[i], "--max-heap") == 0) {
+                setHeapLimit(sizeOption(argc, argv, &i));
+            } else if (strcmp(argv[i], "--lazy") == 0) {
+                lazyCompile = true;
+            } else if (strcmp(argv[i], "--compile-time") == 0) {
+                compileTime = true;
+            } else if (strcmp(argv[i], "--scan-speed") == 0) {
+                scanSpeed = true;
+            } else if (strcmp(argv[i], "--cache") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Error: Option \"--cache\" expects a directory.\n");
+                    exit(64);
+                }
+                cacheDirectory = argv[++i];
+            } else if (strcmp(argv[i], "--jobs") == 0) {
+                compileJobs = (int)numberOption(argc, argv, &i);
+                if (compileJobs < 1 || compileJobs > 64) {
+                    fprintf(stderr, "Error: \"--jobs\" takes 1 to 64 threads.\n");
+                    exit(64);
+                }
             } else {
-                runMain(argv[1]);
+                fprintf(stderr, "Error: Unknown option \"%s\".\n", argv[i]);
+                exit(64);
             }
         }
+
+        if (timeout > 0) startWatchdog(timeout);
+        runMain(argv[1]);
     }
 
     freeVM();
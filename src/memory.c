@@ -1,16 +1,164 @@
 #include <stdlib.h>
+#include <windows.h>
+
+#include "cache.h"
 #include "compiler.h"
 #include "memory.h"
+#include "module.h"
 #include "vm.h"
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// While compiler threads run, the heap is shared: allocations, the object
+// list and string interning go through heapLock, and nothing is collected,
+// since each thread's roots are on its own stack. It is a critical section,
+// so it can be taken again by the thread holding it.
+static CRITICAL_SECTION heapLock;
+static bool heapLockReady = false;
+static bool sharedHeap = false;
+
+void shareHeap(bool shared) {
+    if (!heapLockReady) {
+        InitializeCriticalSection(&heapLock);
+        heapLockReady = true;
+    }
+    sharedHeap = shared;
+}
+
+void lockHeap() {
+    if (sharedHeap) EnterCriticalSection(&heapLock);
+}
+
+void unlockHeap() {
+    if (sharedHeap) LeaveCriticalSection(&heapLock);
+}
+
+// Nothing is collected while a compile is running, so the compiler has no
+// roots to mark. What it allocated is counted and looked at by the first
+// allocation after it.
+static int collectionPauses = 0;
+
+void pauseCollection() {
+    collectionPauses++;
+}
+
+void resumeCollection() {
+    collectionPauses--;
+}
+
+// Scratch memory for the compiler and optimizer, such as the optimizer's
+// instructions, jump patch lists and constant tables. It is allocated by
+// bumping a pointer, is not counted as heap, and is given back all at once:
+// to a mark when the optimizer is done with a function, and completely when
+// the compile ends. Each compiler thread has its own.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+struct ArenaBlock {
+    ArenaBlock* previous;
+    size_t size;
+    size_t used;
+};
+
+// The data starts after the header, rounded up like every allocation
+#define BLOCK_DATA(block) ((uint8_t*)(block) + ARENA_ALIGN(sizeof(ArenaBlock)))
+
+static THREAD_LOCAL ArenaBlock* arena = NULL;
+
+void* arenaGrow(void* pointer, size_t oldSize, size_t newSize) {
+    oldSize = ARENA_ALIGN(oldSize);
+    newSize = ARENA_ALIGN(newSize);
+
+    // The newest allocation grows in place if the block has room
+    if (pointer != NULL && (uint8_t*)pointer + oldSize == BLOCK_DATA(arena) + arena->used &&
+        arena->used - oldSize + newSize <= arena->size) {
+        arena->used += newSize - oldSize;
+        return pointer;
+    }
+
+    if (arena == NULL || arena->used + newSize > arena->size) {
+        size_t size = newSize > ARENA_BLOCK_SIZE ? newSize : ARENA_BLOCK_SIZE;
+        ArenaBlock* block = (ArenaBlock*)malloc(ARENA_ALIGN(sizeof(ArenaBlock)) + size);
+        if (block == NULL) {
+            fprintf(stderr, "Out of memory: could not allocate %zu bytes.\n", size);
+            exit(1);
+        }
+        block->previous = arena;
+        block->size = size;
+        block->used = 0;
+        arena = block;
+    }
+
+    void* result = BLOCK_DATA(arena) + arena->used;
+    arena->used += newSize;
+    if (pointer != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+}
+
+ArenaMark markArena() {
+    ArenaMark mark;
+    mark.block = arena;
+    mark.used = arena != NULL ? arena->used : 0;
+    return mark;
+}
+
+void releaseArena(ArenaMark mark) {
+    while (arena != mark.block) {
+        ArenaBlock* previous = arena->previous;
+        free(arena);
+        arena = previous;
+    }
+    if (arena != NULL) arena->used = mark.used;
+}
+
+// Keeps the first block for the next compile
+void resetArena() {
+    while (arena != NULL && arena->previous != NULL) {
+        ArenaBlock* previous = arena->previous;
+        free(arena);
+        arena = previous;
+    }
+    if (arena != NULL) arena->used = 0;
+}
+
+// For threads that are done compiling
+void freeArena() {
+    ArenaMark empty = {NULL, 0};
+    releaseArena(empty);
+}
+
+// 0 means no limit
+void setHeapLimit(size_t bytes) {
+    vm.maxHeap = bytes;
+}
+
+// Going over the limit first tries a full collection. If that is not enough
+// the allocation still goes through and an out of memory error is thrown
+// right after the instruction that made it, so the caller never sees a
+// failed allocation. Large allocations use tryReallocate() instead.
+static void heapLimitReached() {
+    if (atomic_load_explicit(&vm.interrupted, memory_order_relaxed) & INTERRUPT_OUT_OF_MEMORY) return;
+
+    collectGarbage();
+    if (vm.bytesAllocated > vm.maxHeap) {
+        atomic_fetch_or_explicit(&vm.interrupted, INTERRUPT_OUT_OF_MEMORY, memory_order_relaxed);
+    }
+}
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     size_t sizeDifference = newSize - oldSize;
+    lockHeap();
     vm.bytesAllocated += sizeDifference;
+    unlockHeap();
 
-    if (newSize > oldSize && vm.bytesAllocated > vm.nextGC) {
-        collectGarbage();
+    if (newSize > oldSize && !sharedHeap && collectionPauses == 0) {
+        if (vm.bytesAllocated > vm.nextGC) {
+            collectGarbage();
+        }
+
+        if (vm.maxHeap > 0 && vm.bytesAllocated > vm.maxHeap) {
+            heapLimitReached();
+        }
     }
 
     if (newSize == 0) {
@@ -19,7 +167,46 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     }
 
     void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
+    if (result == NULL) {
+        if (!sharedHeap && collectionPauses == 0) collectGarbage();
+        result = realloc(pointer, newSize);
+        if (result == NULL) {
+            fprintf(stderr, "Out of memory: could not allocate %zu bytes.\n", newSize);
+            exit(1);
+        }
+    }
+    return result;
+}
+
+// Like reallocate(), but returns NULL without touching the block when
+// growing it would go over vm.maxHeap even after a full collection, or when
+// the system has no memory left. For callers that can throw instead.
+void* tryReallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize <= oldSize) return reallocate(pointer, oldSize, newSize);
+
+    size_t sizeDifference = newSize - oldSize;
+    bool collects = !sharedHeap && collectionPauses == 0;
+    if (collects) {
+        if (vm.bytesAllocated + sizeDifference > vm.nextGC) {
+            collectGarbage();
+        }
+
+        if (vm.maxHeap > 0 && vm.bytesAllocated + sizeDifference > vm.maxHeap) {
+            collectGarbage();
+            if (vm.bytesAllocated + sizeDifference > vm.maxHeap) return NULL;
+        }
+    }
+
+    void* result = realloc(pointer, newSize);
+    if (result == NULL) {
+        if (collects) collectGarbage();
+        result = realloc(pointer, newSize);
+        if (result == NULL) return NULL;
+    }
+
+    lockHeap();
+    vm.bytesAllocated += sizeDifference;
+    unlockHeap();
     return result;
 }
 
@@ -74,7 +261,9 @@ static void blackenObject(Obj* object) {
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
+            markObject((Obj*)function->closure);
             markArray(&function->chunk.constants);
+            if (function->lazy != NULL) markLazyBody(function->lazy);
             break;
         }
         case OBJ_INSTANCE: {
@@ -83,10 +272,21 @@ static void blackenObject(Obj* object) {
             markTable(&instance->fields);
             break;
         }
+        case OBJ_JUMP_TABLE: {
+            ObjJumpTable* table = (ObjJumpTable*)object;
+            if (table->keys != NULL) {
+                for (int i = 0; i < table->count; i++) {
+                    markValue(table->keys[i]);
+                }
+            }
+            break;
+        }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
             break;
         case OBJ_NATIVE:
+            markObject((Obj*)((ObjNative*)object)->name);
+            break;
         case OBJ_STRING:
             break;
     }
@@ -112,6 +312,7 @@ static void freeObject(Obj* object) {
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
+            if (function->lazy != NULL) freeLazyBody(function->lazy);
             FREE(ObjFunction, object);
             break;
         }
@@ -121,6 +322,13 @@ static void freeObject(Obj* object) {
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_JUMP_TABLE: {
+            ObjJumpTable* table = (ObjJumpTable*)object;
+            FREE_ARRAY(int, table->targets, table->count + 1);
+            if (table->keys != NULL) FREE_ARRAY(Value, table->keys, table->count);
+            FREE(ObjJumpTable, object);
+            break;
+        }
         case OBJ_NATIVE:
             FREE(ObjNative, object);
             break;
@@ -149,9 +357,13 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
+    markValue(vm.exception);
     markTable(&vm.globals);
     markCompilerRoots();
+    markLinkedModules();
+    markModules();
     markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.outOfMemoryString);
 }
 
 static void traceReferences() {
@@ -7,6 +7,9 @@
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
+#define TRY_ALLOCATE(type, count) \
+    (type*)tryReallocate(NULL, 0, sizeof(type) * (count))
+
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
@@ -14,10 +17,38 @@
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
     (type*)reallocate(pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))
+#define TRY_GROW_ARRAY(type, pointer, oldCount, newCount) \
+    (type*)tryReallocate(pointer, sizeof(type) * (oldCount), \
+        sizeof(type) * (newCount))
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+#define ARENA_ALLOCATE(type, count) \
+    (type*)arenaGrow(NULL, 0, sizeof(type) * (count))
+#define ARENA_GROW(type, pointer, oldCount, newCount) \
+    (type*)arenaGrow(pointer, sizeof(type) * (oldCount), \
+        sizeof(type) * (newCount))
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* tryReallocate(void* pointer, size_t oldSize, size_t newSize);
+void shareHeap(bool shared);
+void lockHeap();
+void unlockHeap();
+void pauseCollection();
+void resumeCollection();
+void* arenaGrow(void* pointer, size_t oldSize, size_t newSize);
+ArenaMark markArena();
+void releaseArena(ArenaMark mark);
+void resetArena();
+void freeArena();
+void setHeapLimit(size_t bytes);
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+#include "module.h"
+#include "source.h"
+
+// A file get() has run. Files are told apart by their full path, so
+// "lib.npp" and "./lib.npp" are one file. reload() only reads the file again
+// if its write time or size changed, and only compiles it again if the
+// hash of what it read changed too.
+typedef struct {
+    char* path;
+    ObjFunction* function;
+    uint64_t written;
+    uint64_t size;
+    uint64_t hash;
+} LoadedModule;
+
+static LoadedModule* loaded = NULL;
+static int loadedCount = 0;
+static int loadedCapacity = 0;
+
+static char* fullPath(const char* path) {
+    char buffer[4096];
+    DWORD length = GetFullPathNameA(path, sizeof(buffer), buffer, NULL);
+    const char* full = length > 0 && length < sizeof(buffer) ? buffer : path;
+
+    size_t size = strlen(full) + 1;
+    char* copy = (char*)malloc(size);
+    if (copy == NULL) {
+        fprintf(stderr, "Out of memory: could not allocate %zu bytes.\n", size);
+        exit(1);
+    }
+    memcpy(copy, full, size);
+    return copy;
+}
+
+static bool stampFile(const char* path, uint64_t* written, uint64_t* size) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) return false;
+
+    *written = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    *size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    return true;
+}
+
+// The function get() or reload() should run for the file. get() only gets
+// one the first time, and MODULE_LOADED after that. The file is registered
+// before it runs, so files that get() each other stop going round. If the
+// run throws, forgetModule() takes it out again.
+ModuleResult findModule(const char* path, bool reload, ObjFunction** function) {
+    char* full = fullPath(path);
+    LoadedModule* module = NULL;
+    for (int i = 0; i < loadedCount; i++) {
+        if (strcmp(loaded[i].path, full) == 0) {
+            module = &loaded[i];
+            break;
+        }
+    }
+
+    if (module != NULL && !reload) {
+        free(full);
+        return MODULE_LOADED;
+    }
+
+    // Room is made first, so nothing is collected between compiling the
+    // function and storing it
+    if (module == NULL && loadedCount == loadedCapacity) {
+        int oldCapacity = loadedCapacity;
+        loadedCapacity = GROW_CAPACITY(oldCapacity);
+        loaded = GROW_ARRAY(LoadedModule, loaded, oldCapacity, loadedCapacity);
+    }
+
+    // A linked image carries the files it loads
+    uint64_t written = 0;
+    uint64_t size = 0;
+    uint64_t hash = 0;
+    ObjFunction* compiled = findLinkedModule(path);
+    if (compiled == NULL) {
+        bool stamped = stampFile(full, &written, &size);
+        if (module != NULL && stamped && written == module->written && size == module->size) {
+            compiled = module->function;
+            hash = module->hash;
+        } else {
+            Source source;
+            if (!openSource(&source, path, false)) {
+                free(full);
+                return MODULE_MISSING;
+            }
+
+            hash = hashBytes(source.chars, source.length);
+            if (module != NULL && hash == module->hash) {
+                compiled = module->function;
+            } else {
+                compiled = takeModule(path, source.chars);
+                if (compiled == NULL) compiled = compile(source.chars);
+            }
+            closeSource(&source);
+
+            if (compiled == NULL) {
+                free(full);
+                return MODULE_COMPILE_ERROR;
+            }
+        }
+    }
+
+    if (module == NULL) {
+        module = &loaded[loadedCount++];
+        module->path = full;
+    } else {
+        free(full);
+    }
+    module->function = compiled;
+    module->written = written;
+    module->size = size;
+    module->hash = hash;
+
+    *function = compiled;
+    return MODULE_RUN;
+}
+
+// A script's frame was thrown out of. If it was a file get() ran, the next
+// get() runs it again instead of finding it half done.
+void forgetModule(ObjFunction* function) {
+    for (int i = 0; i < loadedCount; i++) {
+        if (loaded[i].function != function) continue;
+
+        free(loaded[i].path);
+        loaded[i] = loaded[--loadedCount];
+        return;
+    }
+}
+
+void markModules() {
+    for (int i = 0; i < loadedCount; i++) {
+        markObject((Obj*)loaded[i].function);
+    }
+}
+
+void freeModules() {
+    for (int i = 0; i < loadedCount; i++) {
+        free(loaded[i].path);
+    }
+    FREE_ARRAY(LoadedModule, loaded, loadedCapacity);
+    loaded = NULL;
+    loadedCount = 0;
+    loadedCapacity = 0;
+}
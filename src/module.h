@@ -0,0 +1,18 @@
+#ifndef npp_module_h
+#define npp_module_h
+
+#include "object.h"
+
+typedef enum {
+    MODULE_RUN,
+    MODULE_LOADED,
+    MODULE_MISSING,
+    MODULE_COMPILE_ERROR
+} ModuleResult;
+
+ModuleResult findModule(const char* path, bool reload, ObjFunction** function);
+void forgetModule(ObjFunction* function);
+void markModules();
+void freeModules();
+
+#endif
\ No newline at end of file
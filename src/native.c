@@ -12,6 +12,7 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "module.h"
 #include "vm.h"
 
 #define MAX_ARRAYS 1000
@@ -30,7 +31,7 @@ void init(const char** args, int argsCountt) {
 
 static Value clockNative(int argCount, Value* args) {
     if (argCount != 0) {
-        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return throwError("Expected 0 arguments but got %d.", argCount);
     }
 
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
@@ -38,11 +39,11 @@ static Value clockNative(int argCount, Value* args) {
 
 static Value waitNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     Sleep(AS_NUMBER(args[0]) * 1000);
@@ -91,11 +92,11 @@ void formatDateTime(char* format, char* output) {
 
 static Value timeNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument must be a string.");
+        return throwError("Argument must be a string.");
     }
 
     const char* format = AS_CSTRING(args[0]);
@@ -108,7 +109,7 @@ static Value timeNative(int argCount, Value* args) {
 
 static Value argcNative(int argCount, Value* args) {
     if (argCount != 0) {
-        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return throwError("Expected 0 arguments but got %d.", argCount);
     }
 
     return NUMBER_VAL(globalArgsCount);
@@ -116,21 +117,21 @@ static Value argcNative(int argCount, Value* args) {
 
 static Value argvNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     int index = (int)AS_NUMBER(args[0]);
     if (index < 0 || index >= globalArgsCount) {
-        runtimeError("Index out of bounds. There are %d arguments.", globalArgsCount);
+        return throwError("Index out of bounds. There are %d arguments.", globalArgsCount);
     }
 
     const char* arg = globalArgs[index];
     if (arg == NULL) {
-        runtimeError("Argument at index %d is NULL.", index);
+        return throwError("Argument at index %d is NULL.", index);
     }
 
     return OBJ_VAL(copyString(arg, (int)strlen(arg)));
@@ -138,7 +139,7 @@ static Value argvNative(int argCount, Value* args) {
 
 static Value stringizeNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (IS_STRING(args[0])) {
@@ -148,13 +149,13 @@ static Value stringizeNative(int argCount, Value* args) {
         snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(args[0]));
         return OBJ_VAL(copyString(buffer, (int)strlen(buffer)));
     } else {
-        runtimeError("Unsupported type for stringize.");
+        return throwError("Unsupported type for stringize.");
     }
 }
 
 static Value integizeNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (IS_STRING(args[0])) {
@@ -165,18 +166,18 @@ static Value integizeNative(int argCount, Value* args) {
         if (end != str && *end == '\0') {
             return NUMBER_VAL(number);
         } else {
-            runtimeError("String could not be converted to a number.");
+            return throwError("String could not be converted to a number.");
         }
     } else if (IS_NUMBER(args[0])) {
         return args[0];
     } else {
-        runtimeError("Unsupported type for integize.");
+        return throwError("Unsupported type for integize.");
     }
 }
 
 static Value isNumNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_NUMBER(args[0]));
@@ -184,7 +185,7 @@ static Value isNumNative(int argCount, Value* args) {
 
 static Value isBoolNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_BOOL(args[0]));
@@ -192,7 +193,7 @@ static Value isBoolNative(int argCount, Value* args) {
 
 static Value isObjNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_OBJ(args[0]));
@@ -200,7 +201,7 @@ static Value isObjNative(int argCount, Value* args) {
 
 static Value isStrNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_STRING(args[0]));
@@ -208,7 +209,7 @@ static Value isStrNative(int argCount, Value* args) {
 
 static Value isInstanceNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_INSTANCE(args[0]));
@@ -216,7 +217,7 @@ static Value isInstanceNative(int argCount, Value* args) {
 
 static Value isNullNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_NULL(args[0]));
@@ -224,7 +225,7 @@ static Value isNullNative(int argCount, Value* args) {
 
 static Value isNativeNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_NATIVE(args[0]));
@@ -232,7 +233,7 @@ static Value isNativeNative(int argCount, Value* args) {
 
 static Value isBoundMethodNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_BOUND_METHOD(args[0]));
@@ -241,7 +242,7 @@ static Value isBoundMethodNative(int argCount, Value* args) {
 
 static Value isClassNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     return BOOL_VAL(IS_CLASS(args[0]));
@@ -249,7 +250,7 @@ static Value isClassNative(int argCount, Value* args) {
 
 static Value broadcastNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     printValue(args[0]);
@@ -260,7 +261,7 @@ static Value broadcastNative(int argCount, Value* args) {
 
 static Value broadcastXNNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     printValue(args[0]);
@@ -270,16 +271,16 @@ static Value broadcastXNNative(int argCount, Value* args) {
 
 static Value setColorNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument 1 must be a number.");
+        return throwError("Argument 1 must be a number.");
     }
 
     int colorCode = (int)AS_NUMBER(args[0]);
     if (colorCode < 30 || colorCode > 38) {
-        runtimeError("Argument 1 must be between or equal to 30 and 38.");
+        return throwError("Argument 1 must be between or equal to 30 and 38.");
     }
 
     if (colorCode <= 37) {
@@ -293,7 +294,7 @@ static Value setColorNative(int argCount, Value* args) {
 
 static Value receiveNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     printValue(args[0]);
@@ -314,11 +315,11 @@ static Value receiveNative(int argCount, Value* args) {
 
 static Value systemNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     char* cmd = AS_CSTRING(args[0]);
@@ -405,15 +406,15 @@ uintptr_t cGetFunc(const char* dllPath, const char* funcName, int returnsInt, in
 
 static Value cGetFuncNative(int argCount, Value* args) {
     if (argCount < 4) {
-        runtimeError("Expected at least 4 arguments, but got %d.", argCount);
+        return throwError("Expected at least 4 arguments, but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("First two arguments must be strings.");
+        return throwError("First two arguments must be strings.");
     }
 
     if (!IS_BOOL(args[2])) {
-        runtimeError("Argument 3 must be boolean.");
+        return throwError("Argument 3 must be boolean.");
     }
 
     const char* dllPath = AS_CSTRING(args[0]);
@@ -436,13 +437,13 @@ static Value cGetFuncNative(int argCount, Value* args) {
 
     if (returnsInt) {
         if (result == 0) {
-            runtimeError("The function %s did not return a valid integer result.", funcName);
+            return throwError("The function %s did not return a valid integer result.", funcName);
         }
         return NUMBER_VAL((int)result);
     } else {
         strResult = (const char*)result;
         if (!strResult) {
-            runtimeError("The function %s did not return a valid string result.", funcName);
+            return throwError("The function %s did not return a valid string result.", funcName);
         }
         return OBJ_VAL(copyString(strResult, strlen(strResult)));
     }
@@ -450,7 +451,7 @@ static Value cGetFuncNative(int argCount, Value* args) {
 
 static Value quitNative(int argCount, Value* args) {
     if (argCount != 0) {
-        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return throwError("Expected 0 arguments but got %d.", argCount);
     }
 
     exit(0);
@@ -458,11 +459,11 @@ static Value quitNative(int argCount, Value* args) {
 
 static Value sinNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     return NUMBER_VAL(sin(AS_NUMBER(args[0])));
@@ -470,11 +471,11 @@ static Value sinNative(int argCount, Value* args) {
 
 static Value cosNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     return NUMBER_VAL(cos(AS_NUMBER(args[0])));
@@ -482,11 +483,11 @@ static Value cosNative(int argCount, Value* args) {
 
 static Value tanNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     return NUMBER_VAL(tan(AS_NUMBER(args[0])));
@@ -494,11 +495,11 @@ static Value tanNative(int argCount, Value* args) {
 
 static Value asinNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     return NUMBER_VAL(asin(AS_NUMBER(args[0])));
@@ -506,11 +507,11 @@ static Value asinNative(int argCount, Value* args) {
 
 static Value acosNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     return NUMBER_VAL(acos(AS_NUMBER(args[0])));
@@ -518,11 +519,11 @@ static Value acosNative(int argCount, Value* args) {
 
 static Value atanNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     return NUMBER_VAL(atan(AS_NUMBER(args[0])));
@@ -530,11 +531,11 @@ static Value atanNative(int argCount, Value* args) {
 
 static Value absNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     return NUMBER_VAL(fabs(AS_NUMBER(args[0])));
@@ -542,15 +543,15 @@ static Value absNative(int argCount, Value* args) {
 
 static Value hypotNative(int argCount, Value* args) {
     if (argCount != 2) {
-        runtimeError("Expected 2 arguments but got %d.", argCount);
+        return throwError("Expected 2 arguments but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     if (!IS_NUMBER(args[1])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     return NUMBER_VAL(hypot(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
@@ -558,11 +559,11 @@ static Value hypotNative(int argCount, Value* args) {
 
 static Value sqrtNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 2 arguments but got %d.", argCount);
+        return throwError("Expected 2 arguments but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Argument must be a number.");
+        return throwError("Argument must be a number.");
     }
 
     return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
@@ -570,15 +571,15 @@ static Value sqrtNative(int argCount, Value* args) {
 
 static Value powrNative(int argCount, Value* args) {
     if (argCount != 2) {
-        runtimeError("Expected 2 arguments but got %d.", argCount);
+        return throwError("Expected 2 arguments but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     if (!IS_NUMBER(args[1])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     return NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
@@ -586,15 +587,15 @@ static Value powrNative(int argCount, Value* args) {
 
 static Value mdlsNative(int argCount, Value* args) {
     if (argCount != 2) {
-        runtimeError("Expected 2 arguments but got %d.", argCount);
+        return throwError("Expected 2 arguments but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     if (!IS_NUMBER(args[1])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     int a = AS_NUMBER(args[0]);
@@ -604,15 +605,15 @@ static Value mdlsNative(int argCount, Value* args) {
 
 static Value randNative(int argCount, Value* args) {
     if (argCount != 2) {
-        runtimeError("Expected 2 arguments but got %d.", argCount);
+        return throwError("Expected 2 arguments but got %d.", argCount);
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     if (!IS_NUMBER(args[1])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     srand(time(0)); // Random seed
@@ -623,7 +624,7 @@ static Value randNative(int argCount, Value* args) {
 
 static Value collectGarbageNative(int argCount, Value* args) {
     if (argCount != 0) {
-        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return throwError("Expected 0 arguments but got %d.", argCount);
     }
 
     collectGarbage();
@@ -633,47 +634,69 @@ static Value collectGarbageNative(int argCount, Value* args) {
 
 static Value runtimeErrorNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 arguments but got %d.", argCount);
+        return throwError("Expected 1 arguments but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument 1 must be a string.");
+        return throwError("Argument 1 must be a string.");
     }
 
-    runtimeError(AS_CSTRING(args[0]));
-    
-    return NULL_VAL;
+    return throwError("%s", AS_CSTRING(args[0]));
 }
 
-static Value getNative(int argCount, Value* args) {
+// get() runs a file once, and later calls for the same file do nothing.
+// reload() runs it again, compiling it again only if it changed.
+static Value loadModule(int argCount, Value* args, bool reload) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument must be a string.");
+        return throwError("Argument must be a string.");
     }
 
-    const char* source = readFile(AS_CSTRING(args[0]));
-    ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    ObjFunction* function;
+    switch (findModule(AS_CSTRING(args[0]), reload, &function)) {
+        case MODULE_LOADED:
+            return NULL_VAL;
+        case MODULE_MISSING:
+            return throwError("Could not open file \"%s\".", AS_CSTRING(args[0]));
+        case MODULE_COMPILE_ERROR:
+            return throwError("Could not compile \"%s\".", AS_CSTRING(args[0]));
+        case MODULE_RUN:
+            break;
+    }
 
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
-    push(OBJ_VAL(closure));
-    call_(closure, 0);
-    
+
+    // The file's frame takes over the call's own slot, so its first local
+    // lands right after it and it returns in place of the call. The VM
+    // drops the argument and puts this result in that slot once we return,
+    // leaving the stack as the frame expects.
+    args[-1] = OBJ_VAL(closure);
+    vm.stackTop = args;
+    if (!call_(closure, 0)) forgetModule(function);
+    vm.stackTop = args + argCount;
     return NULL_VAL;
 }
 
+static Value getNative(int argCount, Value* args) {
+    return loadModule(argCount, args, false);
+}
+
+static Value reloadNative(int argCount, Value* args) {
+    return loadModule(argCount, args, true);
+}
+
 static Value strLenNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument must be a string.");
+        return throwError("Argument must be a string.");
     }
 
     int length = strlen(AS_CSTRING(args[0]));
@@ -682,15 +705,15 @@ static Value strLenNative(int argCount, Value* args) {
 
 static Value strIndexNative(int argCount, Value* args) {
     if (argCount != 2) {
-        runtimeError("Expected 2 arguments but got %d.", argCount);
+        return throwError("Expected 2 arguments but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument 1 must be a string.");
+        return throwError("Argument 1 must be a string.");
     }
 
     if (!IS_NUMBER(args[1])) {
-        runtimeError("Argument 2 must be a number.");
+        return throwError("Argument 2 must be a number.");
     }
 
     const char* cstr = AS_CSTRING(args[0]);
@@ -705,9 +728,32 @@ static Value strIndexNative(int argCount, Value* args) {
     return NULL_VAL;
 }
 
+// Array memory goes through tryReallocate() so it counts against the same
+// heap limit as everything else. NULL means there was no room for it.
+static char* copyCString(const char* chars) {
+    size_t length = strlen(chars);
+    char* copy = TRY_ALLOCATE(char, length + 1);
+    if (copy != NULL) memcpy(copy, chars, length + 1);
+    return copy;
+}
+
+static void freeCString(char* chars) {
+    if (chars == NULL) return;
+    FREE_ARRAY(char, chars, strlen(chars) + 1);
+}
+
+static void freeArray(Array* array) {
+    for (int i = 0; i < array->capacity; i++) {
+        freeCString(array->contents[i]);
+    }
+    FREE_ARRAY(char*, array->contents, array->capacity);
+    freeCString(array->name);
+}
+
 void addArray(Array newArray) {
     if (globalArrayCount >= MAX_ARRAYS) {
         runtimeError("Exceeded the maximum number of arrays allowed.");
+        return;
     }
     globalArrays[globalArrayCount++] = newArray;
 }
@@ -724,11 +770,7 @@ Array* getArrayByName(const char* name) {
 void removeArrayFromGlobalList(const char* name) {
     for (int i = 0; i < globalArrayCount; i++) {
         if (strcmp(globalArrays[i].name, name) == 0) {
-            for (int j = 0; j < globalArrays[i].capacity; j++) {
-                free(globalArrays[i].contents[j]);
-            }
-            free(globalArrays[i].contents);
-            free(globalArrays[i].name);
+            freeArray(&globalArrays[i]);
 
             for (int j = i; j < globalArrayCount - 1; j++) {
                 globalArrays[j] = globalArrays[j + 1];
@@ -742,55 +784,71 @@ void removeArrayFromGlobalList(const char* name) {
 
 static Value arrayNative(int argCount, Value* args) {
     if (argCount < 1) {
-        runtimeError("Expected at least 1 argument but got %d.", argCount);
+        return throwError("Expected at least 1 argument but got %d.", argCount);
     }
 
     for (int i = 0; i < argCount; i++) {
         if (!IS_STRING(args[i])) {
-            runtimeError("Arguments must be strings");
+            return throwError("Arguments must be strings");
         }
     }
 
     Array newArray;
     newArray.capacity = argCount - 1;
-    newArray.contents = malloc(newArray.capacity * sizeof(char*));
-    newArray.name = strdup(AS_CSTRING(args[0]));
+    newArray.contents = TRY_ALLOCATE(char*, newArray.capacity);
+    if (newArray.contents == NULL && newArray.capacity > 0) return throwOutOfMemory();
+    for (int i = 0; i < newArray.capacity; i++) {
+        newArray.contents[i] = NULL;
+    }
+
+    newArray.name = copyCString(AS_CSTRING(args[0]));
+    bool copied = newArray.name != NULL;
+    for (int i = 1; copied && i < argCount; i++) {
+        newArray.contents[i - 1] = copyCString(AS_CSTRING(args[i]));
+        copied = newArray.contents[i - 1] != NULL;
+    }
 
-    for (int i = 1; i < argCount; i++) {
-        newArray.contents[i - 1] = strdup(AS_CSTRING(args[i]));
+    if (!copied) {
+        freeArray(&newArray);
+        return throwOutOfMemory();
     }
 
     addArray(newArray);
+    if (vm.hasException) freeArray(&newArray);
 
     return NULL_VAL;
 }
 
 void clsArray() {
+    for (int i = 0; i < globalArrayCount; i++) {
+        freeArray(&globalArrays[i]);
+    }
+    globalArrayCount = 0;
     memset(globalArrays, 0, sizeof(globalArrays));
 }
 
 static Value getArrayNative(int argCount, Value* args) {
     if (argCount != 2) {
-        runtimeError("Expected 2 arguments but got %d.", argCount);
+        return throwError("Expected 2 arguments but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument 1 must be a string.");
+        return throwError("Argument 1 must be a string.");
     }
 
     if (!IS_NUMBER(args[1])) {
-        runtimeError("Argument 2 must be a number.");
+        return throwError("Argument 2 must be a number.");
     }
 
     Array* array = getArrayByName(AS_CSTRING(args[0]));
     if (array == NULL) {
-        runtimeError("Array with name '%s' not found.", AS_CSTRING(args[0]));
+        return throwError("Array with name '%s' not found.", AS_CSTRING(args[0]));
     }
 
     int index = (int)AS_NUMBER(args[1]);
 
     if (index < 0 || index >= array->capacity) {
-        runtimeError("Index %d out of bounds for array '%s' (size: %d).", index, array->name, array->capacity);
+        return throwError("Index %d out of bounds for array '%s' (size: %d).", index, array->name, array->capacity);
     }
 
     return OBJ_VAL(copyString(array->contents[index], (int)strlen(array->contents[index])));
@@ -798,16 +856,16 @@ static Value getArrayNative(int argCount, Value* args) {
 
 static Value lenArrayNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 arguments but got %d.", argCount);
+        return throwError("Expected 1 arguments but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument must be a string.");
+        return throwError("Argument must be a string.");
     }
 
     Array* array = getArrayByName(AS_CSTRING(args[0]));
     if (array == NULL) {
-        runtimeError("Array with name '%s' not found.", AS_CSTRING(args[0]));
+        return throwError("Array with name '%s' not found.", AS_CSTRING(args[0]));
     }
 
     return NUMBER_VAL(array->capacity);
@@ -815,30 +873,33 @@ static Value lenArrayNative(int argCount, Value* args) {
 
 static Value addArrayNative(int argCount, Value* args) {
     if (argCount != 2) {
-        runtimeError("Expected 1 arguments but got %d.", argCount);
+        return throwError("Expected 1 arguments but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     if (!IS_STRING(args[1])) {
-        runtimeError("Arguments must be a number.");
+        return throwError("Arguments must be a number.");
     }
 
     Array* array = getArrayByName(AS_CSTRING(args[0]));
     if (array == NULL) {
-        runtimeError("Array with name '%s' not found.", AS_CSTRING(args[0]));
+        return throwError("Array with name '%s' not found.", AS_CSTRING(args[0]));
     }
 
-    int newCapacity = array->capacity + 1;  // Increment capacity by 1
-    array->contents = realloc(array->contents, newCapacity * sizeof(char*));
+    char* value = copyCString(AS_CSTRING(args[1]));
+    if (value == NULL) return throwOutOfMemory();
 
-    if (array->contents == NULL) {
-        runtimeError("Failed to allocate memory for array expansion.");
+    int newCapacity = array->capacity + 1;  // Increment capacity by 1
+    char** contents = TRY_GROW_ARRAY(char*, array->contents, array->capacity, newCapacity);
+    if (contents == NULL) {
+        freeCString(value);
+        return throwOutOfMemory();
     }
-
-    array->contents[array->capacity] = strdup(AS_CSTRING(args[1]));
+    array->contents = contents;
+    array->contents[array->capacity] = value;
     array->capacity++;
 
     return NULL_VAL;
@@ -846,41 +907,36 @@ static Value addArrayNative(int argCount, Value* args) {
 
 static Value rmvArrayNative(int argCount, Value* args) {
     if (argCount != 2) {
-        runtimeError("Expected 2 arguments but got %d.", argCount);
+        return throwError("Expected 2 arguments but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument 1 must be a string.");
+        return throwError("Argument 1 must be a string.");
     }
 
     if (!IS_NUMBER(args[1])) {
-        runtimeError("Argument 2 must be a number.");
+        return throwError("Argument 2 must be a number.");
     }
 
     Array* array = getArrayByName(AS_CSTRING(args[0]));
     if (array == NULL) {
-        runtimeError("Array with name '%s' not found.", AS_CSTRING(args[0]));
+        return throwError("Array with name '%s' not found.", AS_CSTRING(args[0]));
     }
 
     int index = (int)AS_NUMBER(args[1]);
 
     if (index < 0 || index >= array->capacity) {
-        runtimeError("Index %d out of bounds for array '%s' (size: %d).", index, array->name, array->capacity);
+        return throwError("Index %d out of bounds for array '%s' (size: %d).", index, array->name, array->capacity);
     }
 
-    free(array->contents[index]);
+    freeCString(array->contents[index]);
 
     for (int i = index; i < array->capacity - 1; i++) {
         array->contents[i] = array->contents[i + 1];
     }
 
     int newCapacity = array->capacity - 1;
-    array->contents = realloc(array->contents, newCapacity * sizeof(char*));
-    
-    if (array->contents == NULL && newCapacity > 0) {
-        runtimeError("Failed to allocate memory while shrinking the array.");
-    }
-
+    array->contents = GROW_ARRAY(char*, array->contents, array->capacity, newCapacity);
     array->capacity = newCapacity;
 
     return NULL_VAL;
@@ -888,61 +944,56 @@ static Value rmvArrayNative(int argCount, Value* args) {
 
 static Value cngArrayNative(int argCount, Value* args) {
     if (argCount != 3) {
-        runtimeError("Expected 3 arguments but got %d.", argCount);
+        return throwError("Expected 3 arguments but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument 1 must be a string.");
+        return throwError("Argument 1 must be a string.");
     }
 
     if (!IS_STRING(args[2])) {
-        runtimeError("Argument 3 must be a string.");
+        return throwError("Argument 3 must be a string.");
     }
 
     if (!IS_NUMBER(args[1])) {
-        runtimeError("Argument 2 must be a number.");
+        return throwError("Argument 2 must be a number.");
     }
 
     Array* array = getArrayByName(AS_CSTRING(args[0]));
     if (array == NULL) {
-        runtimeError("Array with name '%s' not found.", AS_CSTRING(args[0]));
+        return throwError("Array with name '%s' not found.", AS_CSTRING(args[0]));
     }
 
     int index = (int)AS_NUMBER(args[1]);
 
     if (index < 0 || index >= array->capacity) {
-        runtimeError("Index %d out of bounds for array '%s' (size: %d).", index, array->name, array->capacity);
+        return throwError("Index %d out of bounds for array '%s' (size: %d).", index, array->name, array->capacity);
     }
 
-    array->contents[index] = AS_CSTRING(args[2]);
-    array->contents = realloc(array->contents, array->capacity * sizeof(char*));
-    array->capacity = array->capacity;
+    char* value = copyCString(AS_CSTRING(args[2]));
+    if (value == NULL) return throwOutOfMemory();
+    freeCString(array->contents[index]);
+    array->contents[index] = value;
 
     return NULL_VAL;
 }
 
 static Value delArrayNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument must be a string.");
+        return throwError("Argument must be a string.");
     }
 
     const char* arrayName = AS_CSTRING(args[0]);
     
     Array* array = getArrayByName(arrayName);
     if (array == NULL) {
-        runtimeError("Array with name '%s' not found.", arrayName);
+        return throwError("Array with name '%s' not found.", arrayName);
     }
 
-    for (int i = 0; i < array->capacity; i++) {
-        free(array->contents[i]);
-    }
-
-    free(array->contents);
-    free(array->name);
     removeArrayFromGlobalList(arrayName);
 
     return NULL_VAL;
@@ -950,18 +1001,18 @@ static Value delArrayNative(int argCount, Value* args) {
 
 static Value bctArrayNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("Expected 1 argument but got %d.", argCount);
+        return throwError("Expected 1 argument but got %d.", argCount);
     }
 
     if (!IS_STRING(args[0])) {
-        runtimeError("Argument must be a string.");
+        return throwError("Argument must be a string.");
     }
 
     const char* arrayName = AS_CSTRING(args[0]);
     
     Array* array = getArrayByName(arrayName);
     if (array == NULL) {
-        runtimeError("Array with name '%s' not found.", arrayName);
+        return throwError("Array with name '%s' not found.", arrayName);
     }
 
     printf("[");
@@ -973,6 +1024,8 @@ static Value bctArrayNative(int argCount, Value* args) {
         }
     }
     printf("]\n");
+
+    return NULL_VAL;
 }
 
 // * Defines all the native functions
@@ -1028,6 +1081,7 @@ void defineNatives() {
     defineNative("collectGarbage", collectGarbageNative);
     defineNative("runtimeError", runtimeErrorNative);
     defineNative("get", getNative);
+    defineNative("reload", reloadNative);
     defineNative("strLen", strLenNative);
     defineNative("strIndex", strIndexNative);
 
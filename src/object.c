@@ -14,8 +14,10 @@ static Obj* allocateObject(size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
     object->isMarked = false;
+    lockHeap();
     object->next = vm.objects;
     vm.objects = object;
+    unlockHeap();
 
     if (debug) {
         printf("\033[0;31m");
@@ -66,7 +68,10 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->shareClosure = false;
     function->name = NULL;
+    function->closure = NULL;
+    function->lazy = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -78,9 +83,28 @@ ObjInstance* newInstance(ObjClass* klass) {
     return instance;
 }
 
+ObjJumpTable* newJumpTable(int count, bool hashed) {
+    int* targets = ALLOCATE(int, count + 1);
+    Value* keys = NULL;
+    if (hashed) {
+        keys = ALLOCATE(Value, count);
+        for (int i = 0; i < count; i++) {
+            keys[i] = NULL_VAL;
+        }
+    }
+
+    ObjJumpTable* table = ALLOCATE_OBJ(ObjJumpTable, OBJ_JUMP_TABLE);
+    table->count = count;
+    table->low = 0;
+    table->keys = keys;
+    table->targets = targets;
+    return table;
+}
+
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->name = NULL;
     return native;
 }
 
@@ -109,25 +133,64 @@ static uint32_t hashString(const char* key, int length) {
 ObjString* takeString(char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
+    lockHeap();
+    ObjString* string = tableFindString(&vm.strings, chars, length, hash);
+    if (string != NULL) {
         FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    } else {
+        string = allocateString(chars, length, hash);
     }
-
-    return allocateString(chars, length, hash);
+    unlockHeap();
+    return string;
 }
 
 ObjString* copyString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
+    lockHeap();
+    ObjString* string = tableFindString(&vm.strings, chars, length, hash);
+    if (string == NULL) {
+        char* heapChars = ALLOCATE(char, length + 1);
+        memcpy(heapChars, chars, length);
+        heapChars[length] = '\0';
+        string = allocateString(heapChars, length, hash);
+    }
+    unlockHeap();
+    return string;
+}
+
+// Joins up to UINT8_COUNT numbers and strings into one string, formatting
+// numbers the way stringize() does. Only the result is interned. Returns
+// NULL if some part is neither, or if the result does not fit under the heap
+// limit.
+ObjString* buildString(Value* parts, int count) {
+    char numbers[UINT8_COUNT][32];
+    int length = 0;
+    for (int i = 0; i < count; i++) {
+        if (IS_STRING(parts[i])) {
+            length += AS_STRING(parts[i])->length;
+        } else if (IS_NUMBER(parts[i])) {
+            length += snprintf(numbers[i], sizeof(numbers[i]), "%g", AS_NUMBER(parts[i]));
+        } else {
+            return NULL;
+        }
+    }
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    char* chars = TRY_ALLOCATE(char, length + 1);
+    if (chars == NULL) return NULL;
+    char* next = chars;
+    for (int i = 0; i < count; i++) {
+        if (IS_STRING(parts[i])) {
+            memcpy(next, AS_CSTRING(parts[i]), AS_STRING(parts[i])->length);
+            next += AS_STRING(parts[i])->length;
+        } else {
+            int numberLength = (int)strlen(numbers[i]);
+            memcpy(next, numbers[i], numberLength);
+            next += numberLength;
+        }
+    }
+    chars[length] = '\0';
 
-    return allocateString(heapChars, length, hash);
+    return takeString(chars, length);
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -166,6 +229,9 @@ void printObject(register Value value) {
         case OBJ_INSTANCE:
             printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
             break;
+        case OBJ_JUMP_TABLE:
+            printf("<jump table>");
+            break;
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
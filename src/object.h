@@ -12,6 +12,7 @@
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_JUMP_TABLE(value)   isObjType(value, OBJ_JUMP_TABLE)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 
@@ -20,6 +21,7 @@
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+#define AS_JUMP_TABLE(value)   ((ObjJumpTable*)AS_OBJ(value))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
@@ -30,6 +32,7 @@ typedef enum {
     OBJ_CLOSURE,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_JUMP_TABLE,
     OBJ_NATIVE,
     OBJ_STRING,
     OBJ_UPVALUE
@@ -41,19 +44,32 @@ struct Obj {
     struct Obj* next;
 };
 
+typedef struct ObjClosure ObjClosure;
+typedef struct LazyBody LazyBody;
+
+// lazy is set while the body is still waiting for its first call, and the
+// chunk is empty until then. shareClosure is set by the compiler when no
+// closure of the function can be compared with another one: a method, or a
+// local def only ever called where it is declared. If it captures nothing
+// too, OP_CLOSURE makes closure once and reuses it.
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    bool shareClosure;
     Chunk chunk;
     ObjString* name;
+    ObjClosure* closure;
+    LazyBody* lazy;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
 
+// name is the global defineNative() put it in, or NULL
 typedef struct {
     Obj obj;
     NativeFn function;
+    ObjString* name;
 } ObjNative;
 
 struct ObjString {
@@ -70,12 +86,12 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+struct ObjClosure {
     Obj obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int upvalueCount;
-} ObjClosure;
+};
 
 typedef struct {
     Obj obj;
@@ -95,15 +111,30 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+// Where a switch statement goes for each case, as offsets into the chunk,
+// with the default in targets[count]. OP_JUMP_TABLE indexes targets with
+// the value minus low. OP_JUMP_HASH looks the value up in keys, an open
+// addressing table of count slots where empty ones hold NULL_VAL, and takes
+// the target in the same position.
+typedef struct {
+    Obj obj;
+    int count;
+    double low;
+    Value* keys;
+    int* targets;
+} ObjJumpTable;
+
 void printValue(Value value);
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
+ObjJumpTable* newJumpTable(int count, bool hashed);
 ObjNative* newNative(NativeFn function);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* buildString(Value* parts, int count);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
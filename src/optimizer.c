@@ -0,0 +1,1555 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+#include "table.h"
+
+int optimizationLevel = 1;
+
+// The optimizer decodes a finished chunk into a list of instructions where
+// jumps and try blocks point at instruction indexes instead of byte offsets.
+// Passes only mark instructions as removed or rewrite them in place, and the
+// bytecode is written out again with every jump recomputed at the end.
+// The targets of switch jump tables are kept in one array, cases, and the
+// target of a table jump is the index of its first one there.
+
+typedef struct {
+    uint8_t op;
+    int operands[6];
+    int length;
+    int start;
+    int target;
+    int line;
+    int inlined;
+    int inlinedLine;
+    bool isLabel;
+    bool removed;
+} Instruction;
+
+// The decoded form of a chunk. It and everything else the passes allocate
+// lives in the compile arena, released as each function is done.
+typedef struct {
+    Chunk* chunk;
+    Instruction* instructions;
+    int count;
+    int* handlers;
+    int* cases;
+    int caseCount;
+    bool changed;
+} Code;
+
+// The operands of an instruction, one letter each: b is a byte, c a
+// constant index and j a jump distance. The long form widens c to three
+// bytes and j from two to three.
+static const char* operandLayout(uint8_t op) {
+    switch (op) {
+        case OP_POP:
+        case OP_DUP:
+        case OP_UNARY:
+        case OP_MODULO:
+        case OP_FLOOR_DIVIDE:
+        case OP_POWER:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_THROW:
+            return "";
+        case OP_CALL:
+        case OP_INLINE_EXIT:
+        case OP_BUILD_STRING:
+            return "b";
+        case OP_LOCAL:
+        case OP_UPVALUE:
+            return "bb";
+        case OP_GLOBAL:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return "cb";
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return "j";
+        case OP_FOR_LOOP:
+        case OP_SCALAR_NEW:
+            return "bbcj";
+        case OP_FOR_STEP:
+            return "bbccj";
+        case OP_INLINE_GUARD:
+            return "bcj";
+        case OP_INLINE_INVOKE_GUARD:
+            return "cbcj";
+        case OP_NATIVE_GUARD:
+            return "ccj";
+        case OP_SCALAR_GET:
+        case OP_SCALAR_SET:
+            return "bbc";
+        case OP_ADD_LOCAL_CONST:
+        case OP_ADD_UPVALUE_CONST:
+        case OP_COMPOUND_LOCAL:
+        case OP_COMPOUND_UPVALUE:
+            return "bcb";
+        case OP_COMPOUND_GLOBAL:
+        case OP_COMPOUND_PROPERTY:
+            return "ccb";
+        default:
+            return "c";
+    }
+}
+
+// The limit of OP_FOR_LOOP and OP_FOR_STEP is laid out like a constant, but
+// holds a local slot unless FOR_CONSTANT_LIMIT is set
+static bool isConstantOperand(Instruction* instruction, const char* layout, int operand) {
+    if (layout[operand] != 'c') return false;
+    if (instruction->op == OP_FOR_LOOP || instruction->op == OP_FOR_STEP) {
+        return operand != 2 || (instruction->operands[1] & FOR_CONSTANT_LIMIT) != 0;
+    }
+    return true;
+}
+
+static int operandSize(char kind, bool isLong) {
+    if (kind == 'b') return 1;
+    if (kind == 'c') return isLong ? 3 : 1;
+    return isLong ? 3 : 2;
+}
+
+// The length of an instruction with the given operands, not counting the
+// upvalue pairs after OP_CLOSURE
+static int encodedLength(uint8_t op, bool isLong) {
+    int length = 1;
+    for (const char* kind = operandLayout(op); *kind != '\0'; kind++) {
+        length += operandSize(*kind, isLong);
+    }
+    return length;
+}
+
+static int upvalueBytes(Chunk* chunk, uint8_t op, int constant) {
+    if (op != OP_CLOSURE) return 0;
+    return AS_FUNCTION(chunk->constants.values[constant])->upvalueCount * 2;
+}
+
+static bool isJump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_FOR_LOOP:
+        case OP_FOR_STEP:
+        case OP_INLINE_GUARD:
+        case OP_INLINE_INVOKE_GUARD:
+        case OP_NATIVE_GUARD:
+        case OP_SCALAR_NEW:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isTableJump(uint8_t op) {
+    return op == OP_JUMP_TABLE || op == OP_JUMP_HASH;
+}
+
+// How many targets a table jump has, counting the default
+static int caseTargets(Code* code, Instruction* instruction) {
+    return AS_JUMP_TABLE(code->chunk->constants.values[instruction->operands[0]])->count + 1;
+}
+
+static int jumpOperand(uint8_t op) {
+    return (int)strlen(operandLayout(op)) - 1;
+}
+
+static bool isBackward(uint8_t op) {
+    return op == OP_LOOP || op == OP_FOR_STEP;
+}
+
+// The jumps that only move the instruction pointer, without a side effect
+// that would have to be kept if the jump went away
+static bool isPlainJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_POP_JUMP_IF_FALSE;
+}
+
+// Execution never falls through to the next instruction after these
+static bool isUnconditional(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN || op == OP_THROW || isTableJump(op);
+}
+
+static void decode(Code* code, Chunk* chunk) {
+    code->chunk = chunk;
+    code->instructions = ARENA_ALLOCATE(Instruction, chunk->count + 1);
+    code->count = 0;
+    code->changed = false;
+
+    int* indexes = ARENA_ALLOCATE(int, chunk->count + 1);
+    int run = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction* instruction = &code->instructions[code->count];
+        bool isLong = (chunk->code[offset] & OP_LONG) != 0;
+        instruction->op = chunk->code[offset] & ~OP_LONG;
+        instruction->start = offset;
+        instruction->target = -1;
+        while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= offset) run++;
+        instruction->line = chunk->lines[run].line;
+        instruction->inlined = chunk->lines[run].inlined;
+        instruction->inlinedLine = chunk->lines[run].inlinedLine;
+        instruction->isLabel = false;
+        instruction->removed = false;
+
+        int position = offset + 1;
+        const char* layout = operandLayout(instruction->op);
+        int operandCount = (int)strlen(layout);
+        for (int i = 0; i < 6; i++) {
+            instruction->operands[i] = 0;
+            if (i >= operandCount) continue;
+
+            for (int size = operandSize(layout[i], isLong); size > 0; size--) {
+                instruction->operands[i] = (instruction->operands[i] << 8) | chunk->code[position++];
+            }
+        }
+        position += upvalueBytes(chunk, instruction->op, instruction->operands[0]);
+        instruction->length = position - offset;
+
+        indexes[offset] = code->count++;
+        offset = position;
+    }
+    indexes[chunk->count] = code->count;
+
+    // The extra instruction at the end stands for the end of the chunk, so
+    // try blocks that reach it have something to point at
+    Instruction* end = &code->instructions[code->count];
+    end->op = OP_RETURN;
+    end->length = 0;
+    end->isLabel = false;
+    end->removed = true;
+
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (!isJump(instruction->op)) continue;
+
+        // The distance is always the last operand
+        int distance = instruction->operands[jumpOperand(instruction->op)];
+        int next = instruction->start + instruction->length;
+        instruction->target = indexes[isBackward(instruction->op) ? next - distance : next + distance];
+        code->instructions[instruction->target].isLabel = true;
+    }
+
+    code->caseCount = 0;
+    for (int i = 0; i < code->count; i++) {
+        if (isTableJump(code->instructions[i].op)) code->caseCount += caseTargets(code, &code->instructions[i]);
+    }
+    code->cases = ARENA_ALLOCATE(int, code->caseCount + 1);
+    for (int i = 0, next = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (!isTableJump(instruction->op)) continue;
+
+        ObjJumpTable* table = AS_JUMP_TABLE(chunk->constants.values[instruction->operands[0]]);
+        instruction->target = next;
+        for (int j = 0; j <= table->count; j++) {
+            code->cases[next] = indexes[table->targets[j]];
+            code->instructions[code->cases[next++]].isLabel = true;
+        }
+    }
+
+    code->handlers = ARENA_ALLOCATE(int, chunk->handlerCount * 3 + 1);
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        code->handlers[i * 3] = indexes[handler->start];
+        code->handlers[i * 3 + 1] = indexes[handler->end];
+        code->handlers[i * 3 + 2] = indexes[handler->target];
+        for (int j = 0; j < 3; j++) {
+            code->instructions[code->handlers[i * 3 + j]].isLabel = true;
+        }
+    }
+}
+
+static int nextLive(Code* code, int index) {
+    do {
+        index++;
+    } while (index < code->count && code->instructions[index].removed);
+    return index;
+}
+
+static int previousLive(Code* code, int index) {
+    do {
+        index--;
+    } while (index >= 0 && code->instructions[index].removed);
+    return index;
+}
+
+// The instruction that runs in place of index, which is index itself unless
+// it was removed
+static int resolve(Code* code, int index) {
+    if (index >= code->count || !code->instructions[index].removed) return index;
+    return nextLive(code, index);
+}
+
+static void resolveLabels(Code* code) {
+    for (int i = 0; i <= code->count; i++) {
+        code->instructions[i].isLabel = false;
+    }
+
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || !isJump(instruction->op)) continue;
+
+        instruction->target = resolve(code, instruction->target);
+        code->instructions[instruction->target].isLabel = true;
+    }
+
+    for (int i = 0; i < code->chunk->handlerCount * 3; i++) {
+        code->handlers[i] = resolve(code, code->handlers[i]);
+        code->instructions[code->handlers[i]].isLabel = true;
+    }
+
+    for (int i = 0; i < code->caseCount; i++) {
+        code->cases[i] = resolve(code, code->cases[i]);
+        code->instructions[code->cases[i]].isLabel = true;
+    }
+}
+
+// Returns the instruction after index when the two can be merged, meaning
+// nothing jumps to the second one, or -1
+static int mergeable(Code* code, int index) {
+    int next = nextLive(code, index);
+    if (next >= code->count || code->instructions[next].isLabel) return -1;
+    return next;
+}
+
+// A removed instruction that something jumps to hands its label on to the
+// instruction that now runs in its place
+static void removeInstruction(Code* code, int index) {
+    Instruction* instruction = &code->instructions[index];
+    instruction->removed = true;
+    if (instruction->isLabel) {
+        code->instructions[nextLive(code, index)].isLabel = true;
+    }
+    code->changed = true;
+}
+
+static bool isPureLoad(Instruction* instruction) {
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_BOOL:
+        case OP_DUP:
+            return true;
+        case OP_LOCAL:
+        case OP_UPVALUE:
+            return instruction->operands[1] == 0;
+        default:
+            return false;
+    }
+}
+
+// A value that is loaded and popped right away does nothing
+static bool removeDeadLoads(Code* code) {
+    bool removed = false;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || !isPureLoad(instruction)) continue;
+
+        int next = nextLive(code, i);
+        if (next < code->count && code->instructions[next].op == OP_POP && !code->instructions[next].isLabel) {
+            removeInstruction(code, next);
+            removeInstruction(code, i);
+            removed = true;
+        }
+    }
+
+    return removed;
+}
+
+// Stores into a local slot that the function never reads, and that no
+// closure captures, are dropped
+static bool removeDeadStores(Code* code) {
+    bool read[UINT8_COUNT] = {false};
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed) continue;
+
+        if ((instruction->op == OP_LOCAL && instruction->operands[1] == 0) ||
+            instruction->op == OP_ADD_LOCAL_CONST || instruction->op == OP_COMPOUND_LOCAL) {
+            read[instruction->operands[0]] = true;
+        } else if (instruction->op == OP_FOR_LOOP || instruction->op == OP_FOR_STEP) {
+            read[instruction->operands[0]] = true;
+            if (!(instruction->operands[1] & FOR_CONSTANT_LIMIT)) read[instruction->operands[2]] = true;
+        } else if (instruction->op == OP_SCALAR_GET || instruction->op == OP_SCALAR_SET) {
+            read[instruction->operands[0]] = true;
+            read[instruction->operands[1]] = true;
+        } else if (instruction->op == OP_CLOSURE) {
+            int count = upvalueBytes(code->chunk, OP_CLOSURE, instruction->operands[0]);
+            uint8_t* upvalues = &code->chunk->code[instruction->start + instruction->length - count];
+            for (int j = 0; j < count; j += 2) {
+                if (upvalues[j]) read[upvalues[j + 1]] = true;
+            }
+        }
+    }
+
+    bool removed = false;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || instruction->op != OP_LOCAL || instruction->operands[1] == 0) continue;
+        if (read[instruction->operands[0]]) continue;
+
+        if (instruction->operands[1] == SET_AND_POP) {
+            instruction->op = OP_POP;
+            instruction->length = 1;
+            removed = true;
+            continue;
+        }
+
+        int next = nextLive(code, i);
+        if (next < code->count && code->instructions[next].op == OP_POP) {
+            removeInstruction(code, i);
+            removed = true;
+        }
+    }
+
+    return removed;
+}
+
+// != and friends compile to a comparison followed by a not
+static bool fuseCompares(Code* code) {
+    bool fused = false;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || instruction->op != OP_COMPARE) continue;
+
+        int next = mergeable(code, i);
+        if (next == -1 || code->instructions[next].op != OP_COMPARE) continue;
+
+        Value name = code->chunk->constants.values[code->instructions[next].operands[0]];
+        if (strcmp(AS_CSTRING(name), "!") == 0) {
+            instruction->op = OP_COMPARE_NOT;
+            removeInstruction(code, next);
+            fused = true;
+        }
+    }
+
+    return fused;
+}
+
+// The operand that says whether an instruction stores and keeps the value,
+// or -1 if it has none
+static int storeOperand(uint8_t op) {
+    switch (op) {
+        case OP_LOCAL:
+        case OP_GLOBAL:
+        case OP_UPVALUE:
+            return 1;
+        case OP_ADD_LOCAL_CONST:
+        case OP_ADD_UPVALUE_CONST:
+        case OP_COMPOUND_LOCAL:
+        case OP_COMPOUND_UPVALUE:
+        case OP_COMPOUND_GLOBAL:
+        case OP_COMPOUND_PROPERTY:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+// Assignments used as statements store a value and then pop it
+static bool fuseStores(Code* code) {
+    bool fused = false;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        int operand = storeOperand(instruction->op);
+        if (instruction->removed || operand == -1) continue;
+        if (instruction->operands[operand] != 1 && instruction->operands[operand] != POSTFIX) continue;
+
+        int next = mergeable(code, i);
+        if (next != -1 && code->instructions[next].op == OP_POP) {
+            instruction->operands[operand] = SET_AND_POP;
+            removeInstruction(code, next);
+            fused = true;
+        }
+    }
+
+    return fused;
+}
+
+// The or operator jumps over a jump: a conditional jump to the right
+// operand, straight after an unconditional one past it
+static bool fuseOrJumps(Code* code) {
+    bool fused = false;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || instruction->op != OP_JUMP_IF_FALSE) continue;
+
+        int next = mergeable(code, i);
+        if (next == -1 || code->instructions[next].op != OP_JUMP) continue;
+        if (resolve(code, instruction->target) != nextLive(code, next)) continue;
+
+        instruction->op = OP_JUMP_IF_TRUE;
+        instruction->target = code->instructions[next].target;
+        removeInstruction(code, next);
+        fused = true;
+    }
+
+    return fused;
+}
+
+// Conditions of if, while and for statements are popped on both sides of
+// the jump, which can be done once by the jump itself as long as nothing
+// else reaches the pop at the target
+static bool fusePopJumps(Code* code) {
+    ArenaMark mark = markArena();
+    int* references = ARENA_ALLOCATE(int, code->count + 1);
+    for (int i = 0; i <= code->count; i++) {
+        references[i] = 0;
+    }
+    for (int i = 0; i < code->count; i++) {
+        if (!code->instructions[i].removed && isJump(code->instructions[i].op)) {
+            references[resolve(code, code->instructions[i].target)]++;
+        }
+    }
+    for (int i = 0; i < code->chunk->handlerCount * 3; i++) {
+        references[code->handlers[i]]++;
+    }
+    for (int i = 0; i < code->caseCount; i++) {
+        references[resolve(code, code->cases[i])]++;
+    }
+
+    bool fused = false;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || instruction->op != OP_JUMP_IF_FALSE) continue;
+
+        int next = mergeable(code, i);
+        int target = resolve(code, instruction->target);
+        if (next == -1 || code->instructions[next].op != OP_POP) continue;
+        if (target >= code->count || target <= next || code->instructions[target].op != OP_POP) continue;
+        if (references[target] != 1) continue;
+
+        int previous = previousLive(code, target);
+        if (!isUnconditional(code->instructions[previous].op)) continue;
+
+        instruction->op = OP_POP_JUMP_IF_FALSE;
+        removeInstruction(code, next);
+        removeInstruction(code, target);
+        references[target]--;
+        fused = true;
+    }
+
+    releaseArena(mark);
+    return fused;
+}
+
+// Jumps that land on another jump go straight to where that one goes.
+// Jumps only go forward, so this always ends.
+static bool threadJumps(Code* code) {
+    bool threaded = false;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || !isJump(instruction->op) || isBackward(instruction->op)) continue;
+
+        int target = resolve(code, instruction->target);
+        if (target >= code->count) continue;
+
+        Instruction* jump = &code->instructions[target];
+        bool follow = jump->op == OP_JUMP ||
+            (jump->op == instruction->op && (jump->op == OP_JUMP_IF_FALSE || jump->op == OP_JUMP_IF_TRUE));
+        if (!follow) continue;
+
+        int destination = resolve(code, jump->target);
+        if (destination > target) {
+            instruction->target = destination;
+            threaded = true;
+        }
+    }
+
+    return threaded;
+}
+
+// Jumps to the very next instruction
+static bool removeUselessJumps(Code* code) {
+    bool removed = false;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || !isPlainJump(instruction->op)) continue;
+        if (resolve(code, instruction->target) != nextLive(code, i)) continue;
+
+        if (instruction->op == OP_POP_JUMP_IF_FALSE) {
+            instruction->op = OP_POP;
+            instruction->length = 1;
+        } else {
+            removeInstruction(code, i);
+        }
+        removed = true;
+    }
+
+    return removed;
+}
+
+// Code after a return, throw or jump that nothing jumps to, such as the
+// implicit return at the end of a function that already returned
+static bool removeUnreachable(Code* code) {
+    ArenaMark mark = markArena();
+    bool* reached = ARENA_ALLOCATE(bool, code->count + 1);
+    int* pending = ARENA_ALLOCATE(int, code->count * 2 + code->chunk->handlerCount + code->caseCount + 1);
+    int pendingCount = 0;
+    for (int i = 0; i <= code->count; i++) {
+        reached[i] = false;
+    }
+
+    pending[pendingCount++] = resolve(code, 0);
+    for (int i = 0; i < code->chunk->handlerCount; i++) {
+        pending[pendingCount++] = code->handlers[i * 3 + 2];
+    }
+
+    while (pendingCount > 0) {
+        int index = pending[--pendingCount];
+        if (index >= code->count || reached[index]) continue;
+        reached[index] = true;
+
+        Instruction* instruction = &code->instructions[index];
+        if (isJump(instruction->op)) {
+            int target = resolve(code, instruction->target);
+            if (!reached[target]) pending[pendingCount++] = target;
+        }
+        if (isTableJump(instruction->op)) {
+            for (int i = 0; i < caseTargets(code, instruction); i++) {
+                int target = resolve(code, code->cases[instruction->target + i]);
+                if (!reached[target]) pending[pendingCount++] = target;
+            }
+        }
+        if (!isUnconditional(instruction->op)) {
+            int next = nextLive(code, index);
+            if (!reached[next]) pending[pendingCount++] = next;
+        }
+    }
+
+    bool removed = false;
+    for (int i = 0; i < code->count; i++) {
+        if (!code->instructions[i].removed && !reached[i]) {
+            removeInstruction(code, i);
+            removed = true;
+        }
+    }
+
+    releaseArena(mark);
+    return removed;
+}
+
+typedef struct {
+    ObjFunction* function;
+    bool isMethod;
+} Candidate;
+
+static THREAD_LOCAL Candidate* candidates = NULL;
+static THREAD_LOCAL int candidateCount = 0;
+static THREAD_LOCAL int candidateCapacity = 0;
+
+// Functions declared at the top level and methods are recorded as the
+// compiler finishes them, so later code can inline calls to them
+void addInlineCandidate(ObjFunction* function, bool isMethod) {
+    if (candidateCapacity < candidateCount + 1) {
+        int oldCapacity = candidateCapacity;
+        candidateCapacity = GROW_CAPACITY(oldCapacity);
+        candidates = GROW_ARRAY(Candidate, candidates, oldCapacity, candidateCapacity);
+    }
+
+    candidates[candidateCount].function = function;
+    candidates[candidateCount].isMethod = isMethod;
+    candidateCount++;
+}
+
+void clearInlineCandidates() {
+    FREE_ARRAY(Candidate, candidates, candidateCapacity);
+    candidates = NULL;
+    candidateCount = 0;
+    candidateCapacity = 0;
+}
+
+// Names defined more than once, such as a method overridden by a subclass,
+// are never inlined
+static ObjFunction* findCandidate(ObjString* name, bool isMethod) {
+    ObjFunction* found = NULL;
+    for (int i = 0; i < candidateCount; i++) {
+        if (candidates[i].isMethod == isMethod && candidates[i].function->name == name) {
+            if (found != NULL) return NULL;
+            found = candidates[i].function;
+        }
+    }
+
+    return found;
+}
+
+static const char* constantName(Code* code, Instruction* instruction) {
+    return AS_CSTRING(code->chunk->constants.values[instruction->operands[0]]);
+}
+
+// How the stack height changes when execution falls through an instruction
+static int stackEffect(Code* code, Instruction* instruction) {
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_BOOL:
+        case OP_DUP:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_SCALAR_GET:
+            return 1;
+        case OP_LOCAL:
+        case OP_GLOBAL:
+        case OP_UPVALUE:
+            return instruction->operands[1] == 0 ? 1 : instruction->operands[1] == SET_AND_POP ? -1 : 0;
+        case OP_ADD_LOCAL_CONST:
+        case OP_ADD_UPVALUE_CONST:
+            return instruction->operands[2] == SET_AND_POP ? 0 : 1;
+        case OP_COMPOUND_LOCAL:
+        case OP_COMPOUND_UPVALUE:
+        case OP_COMPOUND_GLOBAL:
+            return instruction->operands[2] == SET_AND_POP ? -1 : 0;
+        case OP_COMPOUND_PROPERTY:
+            return instruction->operands[2] == SET_AND_POP ? -2 : -1;
+        case OP_COMPARE:
+        case OP_COMPARE_NOT:
+            return strcmp(constantName(code, instruction), "!") == 0 ? 0 : -1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_BINARY:
+        case OP_MODULO:
+        case OP_FLOOR_DIVIDE:
+        case OP_POWER:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_METHOD:
+            return -1;
+        case OP_CALL:
+            return -instruction->operands[0];
+        case OP_BUILD_STRING:
+            return 1 - instruction->operands[0];
+        case OP_INVOKE:
+            return -instruction->operands[1];
+        case OP_SUPER_INVOKE:
+            return -instruction->operands[1] - 1;
+        default:
+            return 0;
+    }
+}
+
+// Longest expression shareExpressions looks for, in instructions
+#define MAX_SHARED_LENGTH 16
+
+// Whether the instruction only works out a value from its operands and the
+// values below it on the stack. Given the same ones, it gives the same result
+// or throws the same error, and it changes nothing else.
+static bool isPureOperation(Instruction* instruction) {
+    if (isPureLoad(instruction)) return true;
+
+    switch (instruction->op) {
+        case OP_GLOBAL:
+            return instruction->operands[1] == 0;
+        case OP_BINARY:
+        case OP_UNARY:
+        case OP_MODULO:
+        case OP_FLOOR_DIVIDE:
+        case OP_POWER:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_COMPARE:
+        case OP_COMPARE_NOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool sameInstruction(Instruction* a, Instruction* b) {
+    if (a->op != b->op || a->length != b->length) return false;
+    for (int i = 0; i < 6; i++) {
+        if (a->operands[i] != b->operands[i]) return false;
+    }
+    return true;
+}
+
+// Whether the instructions at indexes, which run one after another, push
+// exactly one value without taking any that were there before them
+static bool isExpression(Code* code, int* indexes, int count) {
+    int depth = 0;
+    for (int i = 0; i < count; i++) {
+        depth += stackEffect(code, &code->instructions[indexes[i]]);
+        if (depth <= 0) return false;
+    }
+    return depth == 1;
+}
+
+// A pure expression worked out twice in a row, as in (a * b) * (a * b) or
+// x * x, is worked out once and duplicated. Nothing runs between the two,
+// so the second would give the same value. A lone constant is left alone,
+// since loading it again costs no more than OP_DUP.
+static bool shareExpressions(Code* code) {
+    bool shared = false;
+    int indexes[MAX_SHARED_LENGTH];
+    int copy[MAX_SHARED_LENGTH];
+    for (int end = 0; end < code->count; end++) {
+        if (code->instructions[end].removed) continue;
+
+        // indexes holds the expression backwards from end, so the longest
+        // one that repeats is tried first
+        int count = 0;
+        for (int i = end; i >= 0 && count < MAX_SHARED_LENGTH; i = previousLive(code, i)) {
+            if (!isPureOperation(&code->instructions[i])) break;
+            indexes[count++] = i;
+            if (code->instructions[i].isLabel) break;
+        }
+
+        for (int length = count; length > 0; length--) {
+            int expression[MAX_SHARED_LENGTH];
+            for (int i = 0; i < length; i++) {
+                expression[i] = indexes[length - 1 - i];
+            }
+            if (!isExpression(code, expression, length)) continue;
+
+            Instruction* first = &code->instructions[expression[0]];
+            if (length == 1 && first->op != OP_LOCAL && first->op != OP_UPVALUE && first->op != OP_GLOBAL) continue;
+
+            int next = end;
+            bool repeats = true;
+            for (int i = 0; i < length && repeats; i++) {
+                next = nextLive(code, next);
+                copy[i] = next;
+                repeats = next < code->count && !code->instructions[next].isLabel &&
+                    sameInstruction(&code->instructions[expression[i]], &code->instructions[next]);
+            }
+            if (!repeats) continue;
+
+            Instruction* dup = &code->instructions[copy[0]];
+            dup->op = OP_DUP;
+            dup->length = 1;
+            for (int i = 1; i < length; i++) {
+                removeInstruction(code, copy[i]);
+            }
+            code->changed = true;
+            shared = true;
+            break;
+        }
+    }
+
+    return shared;
+}
+
+// Works out how many values are on the stack before each instruction,
+// counting the function itself in slot zero. Returns NULL if some
+// instruction can be reached with two different heights.
+static int* stackDepths(Code* code, int arity) {
+    int* depths = ARENA_ALLOCATE(int, code->count + 1);
+    int* pending = ARENA_ALLOCATE(int, code->count + 1);
+    int pendingCount = 0;
+    bool consistent = true;
+    for (int i = 0; i <= code->count; i++) {
+        depths[i] = -1;
+    }
+
+    #define REACH(index, depth) \
+        do { \
+            int reached = (index); \
+            if (depths[reached] == -1) { \
+                depths[reached] = (depth); \
+                pending[pendingCount++] = reached; \
+            } else if (depths[reached] != (depth)) { \
+                consistent = false; \
+            } \
+        } while (false)
+
+    REACH(resolve(code, 0), arity + 1);
+    for (int i = 0; i < code->chunk->handlerCount; i++) {
+        REACH(code->handlers[i * 3 + 2], code->chunk->handlers[i].stackDepth + 1);
+    }
+
+    while (pendingCount > 0 && consistent) {
+        int index = pending[--pendingCount];
+        if (index >= code->count) continue;
+
+        Instruction* instruction = &code->instructions[index];
+        int depth = depths[index];
+        int next = nextLive(code, index);
+        switch (instruction->op) {
+            case OP_RETURN:
+            case OP_THROW:
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+                REACH(resolve(code, instruction->target), depth);
+                break;
+            case OP_POP_JUMP_IF_FALSE:
+                REACH(resolve(code, instruction->target), depth - 1);
+                REACH(next, depth - 1);
+                break;
+            case OP_INLINE_GUARD:
+                REACH(resolve(code, instruction->target), depth - instruction->operands[0]);
+                REACH(next, depth);
+                break;
+            case OP_INLINE_INVOKE_GUARD:
+                REACH(resolve(code, instruction->target), depth - instruction->operands[1]);
+                REACH(next, depth);
+                break;
+            case OP_INLINE_EXIT:
+                REACH(next, instruction->operands[0] + 1);
+                break;
+            case OP_NATIVE_GUARD:
+                REACH(resolve(code, instruction->target), depth + 1);
+                REACH(next, depth);
+                break;
+            case OP_JUMP_TABLE:
+            case OP_JUMP_HASH:
+                for (int i = 0; i < caseTargets(code, instruction); i++) {
+                    REACH(resolve(code, code->cases[instruction->target + i]), depth - 1);
+                }
+                break;
+            default:
+                if (isJump(instruction->op)) REACH(resolve(code, instruction->target), depth);
+                REACH(next, depth + stackEffect(code, instruction));
+                break;
+        }
+    }
+
+    #undef REACH
+
+    return consistent ? depths : NULL;
+}
+
+#define INLINE_MAX_BYTES 48
+
+// Small functions without closures, upvalues or try blocks that end in
+// their only return can be copied into the caller. A body not compiled yet
+// can't be.
+static bool decodeInlinable(ObjFunction* function, Code* body) {
+    Chunk* chunk = &function->chunk;
+    if (function->lazy != NULL || function->upvalueCount > 0 || chunk->handlerCount > 0 || chunk->count > INLINE_MAX_BYTES) return false;
+
+    decode(body, chunk);
+    for (int i = 0; i < body->count; i++) {
+        switch (body->instructions[i].op) {
+            case OP_CONSTANT:
+            case OP_BOOL:
+            case OP_POP:
+            case OP_DUP:
+            case OP_LOCAL:
+            case OP_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_COMPARE:
+            case OP_COMPARE_NOT:
+            case OP_BINARY:
+            case OP_UNARY:
+            case OP_MODULO:
+            case OP_FLOOR_DIVIDE:
+            case OP_POWER:
+            case OP_BIT_AND:
+            case OP_BIT_OR:
+            case OP_BIT_XOR:
+            case OP_SHIFT_LEFT:
+            case OP_SHIFT_RIGHT:
+            case OP_BUILD_STRING:
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_FOR_LOOP:
+            case OP_FOR_STEP:
+            case OP_CALL:
+            case OP_NATIVE_GUARD:
+            case OP_INVOKE:
+            case OP_THROW:
+            case OP_ADD_LOCAL_CONST:
+            case OP_COMPOUND_LOCAL:
+            case OP_COMPOUND_GLOBAL:
+            case OP_COMPOUND_PROPERTY:
+                break;
+            case OP_RETURN:
+                if (i == body->count - 1) break;
+                // Fallthrough
+            default:
+                return false;
+        }
+    }
+
+    if (body->count == 0 || body->instructions[body->count - 1].op != OP_RETURN) {
+        return false;
+    }
+    return true;
+}
+
+// Copies a callee constant into the caller, reusing the slot if the same
+// constant was already copied for this call
+static int copyConstant(Chunk* caller, Code* body, Instruction* instruction, int operand, int* copied) {
+    int index = instruction->operands[operand];
+    if (copied[index] == -1) {
+        copied[index] = addConstant(caller, body->chunk->constants.values[index]);
+    }
+    return copied[index];
+}
+
+// Adjusts a body instruction to run in the caller's frame, where the callee's
+// slot zero is at base
+static void adjustInlined(Code* code, Code* body, Instruction* instruction, int base, int* copied) {
+    Chunk* caller = code->chunk;
+    switch (instruction->op) {
+        case OP_LOCAL:
+            instruction->operands[0] += base;
+            break;
+        case OP_ADD_LOCAL_CONST:
+        case OP_COMPOUND_LOCAL:
+            instruction->operands[0] += base;
+            instruction->operands[1] = copyConstant(caller, body, instruction, 1, copied);
+            break;
+        case OP_COMPOUND_GLOBAL:
+        case OP_COMPOUND_PROPERTY:
+        case OP_NATIVE_GUARD:
+            instruction->operands[0] = copyConstant(caller, body, instruction, 0, copied);
+            instruction->operands[1] = copyConstant(caller, body, instruction, 1, copied);
+            break;
+        case OP_FOR_LOOP:
+        case OP_FOR_STEP:
+            instruction->operands[0] += base;
+            if (instruction->operands[1] & FOR_CONSTANT_LIMIT) {
+                instruction->operands[2] = copyConstant(caller, body, instruction, 2, copied);
+            } else {
+                instruction->operands[2] += base;
+            }
+            if (instruction->op == OP_FOR_STEP) {
+                instruction->operands[3] = copyConstant(caller, body, instruction, 3, copied);
+            }
+            break;
+        case OP_CONSTANT:
+        case OP_BOOL:
+        case OP_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_COMPARE:
+        case OP_COMPARE_NOT:
+        case OP_BINARY:
+        case OP_INVOKE:
+            instruction->operands[0] = copyConstant(caller, body, instruction, 0, copied);
+            break;
+        case OP_RETURN:
+            instruction->op = OP_INLINE_EXIT;
+            instruction->operands[0] = base;
+            instruction->length = 2;
+            break;
+        default:
+            break;
+    }
+}
+
+typedef struct {
+    int index;
+    int base;
+    ObjFunction* function;
+    Code body;
+} InlineSite;
+
+// The callee of a call is whatever was pushed at base. Guessing the global
+// that was loaded there is enough, the guard checks it at runtime.
+static ObjFunction* findCallee(Code* code, int* depths, int index, int base) {
+    for (int i = previousLive(code, index); i >= 0; i = previousLive(code, i)) {
+        if (depths[i] == -1 || depths[i] > base) continue;
+
+        Instruction* instruction = &code->instructions[i];
+        if (depths[i] == base && instruction->op == OP_GLOBAL && instruction->operands[1] == 0) {
+            return findCandidate(AS_STRING(code->chunk->constants.values[instruction->operands[0]]), false);
+        }
+        return NULL;
+    }
+
+    return NULL;
+}
+
+// Calls to small global functions and methods are replaced by a copy of the
+// callee's body behind a guard. The guard checks that the callee is still
+// the function that was inlined and makes a normal call if not.
+static bool inlineCalls(Code* code, ObjFunction* caller) {
+    int* depths = stackDepths(code, caller->arity);
+    if (depths == NULL) return false;
+
+    InlineSite* sites = NULL;
+    int siteCount = 0;
+    int siteCapacity = 0;
+    int added = 0;
+
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || depths[i] == -1) continue;
+        if (instruction->op != OP_CALL && instruction->op != OP_INVOKE) continue;
+
+        int argCount = instruction->op == OP_CALL ? instruction->operands[0] : instruction->operands[1];
+        int base = depths[i] - argCount - 1;
+        ObjFunction* callee = instruction->op == OP_CALL ? findCallee(code, depths, i, base) :
+            findCandidate(AS_STRING(code->chunk->constants.values[instruction->operands[0]]), true);
+        if (callee == NULL || callee == caller || callee->arity != argCount) continue;
+
+        InlineSite site;
+        if (!decodeInlinable(callee, &site.body)) continue;
+
+        int maxSlot = 0;
+        for (int j = 0; j < site.body.count; j++) {
+            Instruction* bodyInstruction = &site.body.instructions[j];
+            uint8_t op = bodyInstruction->op;
+            if (op == OP_LOCAL || op == OP_FOR_LOOP || op == OP_FOR_STEP || op == OP_ADD_LOCAL_CONST || op == OP_COMPOUND_LOCAL) {
+                if (bodyInstruction->operands[0] > maxSlot) maxSlot = bodyInstruction->operands[0];
+            }
+            if ((op == OP_FOR_LOOP || op == OP_FOR_STEP) && !(bodyInstruction->operands[1] & FOR_CONSTANT_LIMIT)) {
+                if (bodyInstruction->operands[2] > maxSlot) maxSlot = bodyInstruction->operands[2];
+            }
+        }
+
+        // Every constant of the callee might need a slot in the caller
+        if (base + maxSlot > UINT8_MAX || callee->chunk.constants.count > UINT8_COUNT ||
+            code->chunk->constants.count + added + callee->chunk.constants.count + 1 > UINT24_MAX) {
+            continue;
+        }
+
+        site.index = i;
+        site.base = base;
+        site.function = callee;
+        added += callee->chunk.constants.count + 1;
+        if (siteCapacity < siteCount + 1) {
+            int oldCapacity = siteCapacity;
+            siteCapacity = GROW_CAPACITY(oldCapacity);
+            sites = ARENA_GROW(InlineSite, sites, oldCapacity, siteCapacity);
+        }
+        sites[siteCount++] = site;
+    }
+
+    if (siteCount == 0) return false;
+
+    int capacity = code->count + 1;
+    for (int i = 0; i < siteCount; i++) {
+        capacity += sites[i].body.count;
+    }
+
+    Instruction* instructions = ARENA_ALLOCATE(Instruction, capacity);
+    int* indexes = ARENA_ALLOCATE(int, code->count + 1);
+    int count = 0;
+    for (int i = 0, site = 0; i <= code->count; i++) {
+        indexes[i] = count;
+        if (site < siteCount && sites[site].index == i) {
+            count += sites[site++].body.count + 1;
+        } else {
+            count++;
+        }
+    }
+
+    count = 0;
+    for (int i = 0, site = 0; i <= code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (site == siteCount || sites[site].index != i) {
+            instructions[count] = *instruction;
+            if (i < code->count && isJump(instruction->op)) {
+                instructions[count].target = indexes[instruction->target];
+            }
+            count++;
+            continue;
+        }
+
+        InlineSite* inlined = &sites[site++];
+        Instruction* guard = &instructions[count++];
+        *guard = *instruction;
+        guard->target = indexes[i + 1];
+        int function = addConstant(code->chunk, OBJ_VAL(inlined->function));
+        if (instruction->op == OP_CALL) {
+            guard->op = OP_INLINE_GUARD;
+            guard->operands[1] = function;
+            guard->length = 5;
+        } else {
+            guard->op = OP_INLINE_INVOKE_GUARD;
+            guard->operands[2] = function;
+            guard->length = 6;
+        }
+
+        int copied[UINT8_COUNT];
+        for (int j = 0; j < UINT8_COUNT; j++) {
+            copied[j] = -1;
+        }
+
+        int bodyStart = count;
+        for (int j = 0; j < inlined->body.count; j++) {
+            Instruction* bodyInstruction = &instructions[count++];
+            *bodyInstruction = inlined->body.instructions[j];
+            bodyInstruction->inlinedLine = bodyInstruction->line;
+            bodyInstruction->line = instruction->line;
+            bodyInstruction->inlined = function;
+            bodyInstruction->isLabel = false;
+            if (isJump(bodyInstruction->op)) bodyInstruction->target += bodyStart;
+            adjustInlined(code, &inlined->body, bodyInstruction, inlined->base, copied);
+        }
+    }
+
+    for (int i = 0; i < code->chunk->handlerCount * 3; i++) {
+        code->handlers[i] = indexes[code->handlers[i]];
+    }
+    for (int i = 0; i < code->caseCount; i++) {
+        code->cases[i] = indexes[code->cases[i]];
+    }
+
+    code->instructions = instructions;
+    code->count = count - 1;
+    code->changed = true;
+    return true;
+}
+
+// Whether two instructions share a run in the line table
+static bool sameLine(Instruction* a, Instruction* b) {
+    return a->line == b->line && a->inlined == b->inlined && a->inlinedLine == b->inlinedLine;
+}
+
+// Each instruction takes its long form when one of its constants doesn't fit
+// in a byte or its jump in two. Making a jump long can push another one out
+// of range, so the sizes are worked out again until nothing changes.
+static void lower(Code* code) {
+    Chunk* chunk = code->chunk;
+    bool* wide = ARENA_ALLOCATE(bool, code->count + 1);
+    int* positions = ARENA_ALLOCATE(int, code->count + 1);
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        const char* layout = operandLayout(instruction->op);
+        wide[i] = false;
+        for (int j = 0; layout[j] != '\0'; j++) {
+            if (layout[j] == 'c' && instruction->operands[j] > UINT8_MAX) wide[i] = true;
+        }
+    }
+
+    int count;
+    bool widened;
+    do {
+        count = 0;
+        for (int i = 0; i <= code->count; i++) {
+            positions[i] = count;
+            Instruction* instruction = &code->instructions[i];
+            if (instruction->removed) continue;
+            count += encodedLength(instruction->op, wide[i]) +
+                upvalueBytes(chunk, instruction->op, instruction->operands[0]);
+        }
+
+        widened = false;
+        for (int i = 0; i < code->count; i++) {
+            Instruction* instruction = &code->instructions[i];
+            if (instruction->removed || wide[i] || !isJump(instruction->op)) continue;
+
+            int next = positions[i] + encodedLength(instruction->op, false);
+            int target = positions[instruction->target];
+            if ((isBackward(instruction->op) ? next - target : target - next) > UINT16_MAX) {
+                wide[i] = true;
+                widened = true;
+            }
+        }
+    } while (widened);
+
+    int lineCount = 0;
+    Instruction* previous = NULL;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || (previous != NULL && sameLine(previous, instruction))) continue;
+        previous = instruction;
+        lineCount++;
+    }
+
+    uint8_t* bytes = ALLOCATE(uint8_t, count);
+    LineStart* lines = ALLOCATE(LineStart, lineCount);
+    lineCount = 0;
+    previous = NULL;
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed) continue;
+
+        int offset = positions[i];
+        int next = offset + encodedLength(instruction->op, wide[i]);
+        if (isJump(instruction->op)) {
+            int target = positions[instruction->target];
+            instruction->operands[jumpOperand(instruction->op)] =
+                isBackward(instruction->op) ? next - target : target - next;
+        }
+
+        int position = offset;
+        bytes[position++] = wide[i] ? instruction->op | OP_LONG : instruction->op;
+        const char* layout = operandLayout(instruction->op);
+        for (int j = 0; layout[j] != '\0'; j++) {
+            for (int size = operandSize(layout[j], wide[i]) - 1; size >= 0; size--) {
+                bytes[position++] = (instruction->operands[j] >> (size * 8)) & 0xff;
+            }
+        }
+
+        int upvalues = upvalueBytes(chunk, instruction->op, instruction->operands[0]);
+        memcpy(&bytes[position], &chunk->code[instruction->start + instruction->length - upvalues], upvalues);
+        position += upvalues;
+
+        if (previous == NULL || !sameLine(previous, instruction)) {
+            lines[lineCount].offset = offset;
+            lines[lineCount].line = instruction->line;
+            lines[lineCount].inlined = instruction->inlined;
+            lines[lineCount].inlinedLine = instruction->inlinedLine;
+            lineCount++;
+            previous = instruction;
+        }
+    }
+
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed || !isTableJump(instruction->op)) continue;
+
+        ObjJumpTable* table = AS_JUMP_TABLE(chunk->constants.values[instruction->operands[0]]);
+        for (int j = 0; j <= table->count; j++) {
+            table->targets[j] = positions[resolve(code, code->cases[instruction->target + j])];
+        }
+    }
+
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        handler->start = positions[code->handlers[i * 3]];
+        handler->end = positions[code->handlers[i * 3 + 1]];
+        handler->target = positions[code->handlers[i * 3 + 2]];
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code = bytes;
+    chunk->lines = lines;
+    chunk->lineCount = lineCount;
+    chunk->lineCapacity = lineCount;
+    chunk->count = count;
+    chunk->capacity = count;
+}
+
+static void runPasses(Code* code) {
+    bool changed;
+    do {
+        changed = false;
+        resolveLabels(code);
+        changed |= removeDeadStores(code);
+        changed |= removeDeadLoads(code);
+        changed |= fuseCompares(code);
+        changed |= fuseStores(code);
+        changed |= fuseOrJumps(code);
+        changed |= fusePopJumps(code);
+        changed |= threadJumps(code);
+        changed |= removeUselessJumps(code);
+        changed |= removeUnreachable(code);
+        if (optimizationLevel >= 2) changed |= shareExpressions(code);
+        code->changed |= changed;
+    } while (changed);
+}
+
+// Returns how many bytes the chunk shrank by, which is negative when calls
+// were inlined
+int optimizeFunction(ObjFunction* function) {
+    if (optimizationLevel == 0) return 0;
+
+    Chunk* chunk = &function->chunk;
+    ArenaMark mark = markArena();
+    Code code;
+    decode(&code, chunk);
+    runPasses(&code);
+
+    if (optimizationLevel >= 2 && inlineCalls(&code, function)) {
+        runPasses(&code);
+    }
+
+    int before = chunk->count;
+    if (code.changed) lower(&code);
+
+    releaseArena(mark);
+    return before - chunk->count;
+}
+
+// The instruction that starts at offset, or the one it falls inside
+static int instructionAt(Code* code, int offset) {
+    int low = 0;
+    int high = code->count;
+    while (high - low > 1) {
+        int middle = (low + high) / 2;
+        if (code->instructions[middle].start <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return offset >= code->chunk->count ? code->count : low;
+}
+
+void widenJumps(ObjFunction* function, int* jumps, int count) {
+    ArenaMark mark = markArena();
+    Code code;
+    decode(&code, &function->chunk);
+    for (int i = 0; i < count; i++) {
+        int offset = jumps[i * 2];
+        int target = jumps[i * 2 + 1];
+        if (offset >= function->chunk.count || target > function->chunk.count) continue;
+
+        Instruction* instruction = &code.instructions[instructionAt(&code, offset)];
+        if (!isJump(instruction->op)) continue;
+        instruction->target = instructionAt(&code, target);
+    }
+
+    lower(&code);
+    releaseArena(mark);
+}
+
+// A top-level def or global, which --link takes out when no file of the
+// program names it. function is NULL for a global that holds a constant.
+typedef struct {
+    ObjString* name;
+    ObjFunction* function;
+    bool live;
+} Definition;
+
+// A closure of a function with no upvalues, or a constant, stored straight
+// into a global. Neither does anything else, so the pair can go.
+static bool isDefinition(Code* code, int index) {
+    Instruction* instruction = &code->instructions[index];
+    if (instruction->removed) return false;
+
+    if (instruction->op == OP_CLOSURE) {
+        ObjFunction* function = AS_FUNCTION(code->chunk->constants.values[instruction->operands[0]]);
+        if (function->upvalueCount != 0) return false;
+    } else if (instruction->op != OP_CONSTANT && instruction->op != OP_BOOL) {
+        return false;
+    }
+
+    int next = mergeable(code, index);
+    return next != -1 && code->instructions[next].op == OP_DEFINE_GLOBAL;
+}
+
+// Adds every string the function and the functions inside it load as a
+// constant to names. The bodies of a script's definitions are left out,
+// since they only count once something names the definition.
+static void addUsedNames(ObjFunction* function, Table* names, bool isScript) {
+    ArenaMark mark = markArena();
+    Code code;
+    decode(&code, &function->chunk);
+    for (int i = 0; i < code.count; i++) {
+        Instruction* instruction = &code.instructions[i];
+        if (isScript && instruction->op == OP_CLOSURE && isDefinition(&code, i)) {
+            i = mergeable(&code, i);
+            continue;
+        }
+        if (instruction->op == OP_DEFINE_GLOBAL) continue;
+
+        const char* layout = operandLayout(instruction->op);
+        for (int j = 0; layout[j] != '\0'; j++) {
+            if (!isConstantOperand(instruction, layout, j)) continue;
+
+            Value value = code.chunk->constants.values[instruction->operands[j]];
+            if (IS_STRING(value)) {
+                tableSet(names, AS_STRING(value), TRUE_VAL);
+            } else if (instruction->op == OP_CLOSURE && IS_FUNCTION(value)) {
+                addUsedNames(AS_FUNCTION(value), names, false);
+            }
+        }
+    }
+    releaseArena(mark);
+}
+
+static bool isConstantUsed(Code* code, int constant) {
+    for (int i = 0; i < code->count; i++) {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed) continue;
+        if (instruction->inlined == constant) return true;
+
+        const char* layout = operandLayout(instruction->op);
+        for (int j = 0; layout[j] != '\0'; j++) {
+            if (isConstantOperand(instruction, layout, j) && instruction->operands[j] == constant) return true;
+        }
+    }
+    return false;
+}
+
+// Globals are looked up by name, so a def or global is unused when no
+// instruction in any of the scripts, or in a def that is used, loads its
+// name. Returns how many were taken out.
+int dropUnusedDefinitions(ObjFunction** scripts, int count) {
+    Table names;
+    initTable(&names);
+    ArenaMark mark = markArena();
+
+    Definition* definitions = NULL;
+    int definitionCount = 0;
+    int definitionCapacity = 0;
+    for (int i = 0; i < count; i++) {
+        Code code;
+        decode(&code, &scripts[i]->chunk);
+        for (int j = 0; j < code.count; j++) {
+            if (!isDefinition(&code, j)) continue;
+
+            if (definitionCount == definitionCapacity) {
+                int oldCapacity = definitionCapacity;
+                definitionCapacity = GROW_CAPACITY(oldCapacity);
+                definitions = ARENA_GROW(Definition, definitions, oldCapacity, definitionCapacity);
+            }
+            Definition* definition = &definitions[definitionCount++];
+            Instruction* define = &code.instructions[mergeable(&code, j)];
+            definition->name = AS_STRING(code.chunk->constants.values[define->operands[0]]);
+            Value value = code.chunk->constants.values[code.instructions[j].operands[0]];
+            definition->function = code.instructions[j].op == OP_CLOSURE ? AS_FUNCTION(value) : NULL;
+            definition->live = false;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        addUsedNames(scripts[i], &names, true);
+    }
+
+    bool changed;
+    do {
+        changed = false;
+        for (int i = 0; i < definitionCount; i++) {
+            Value unused;
+            if (definitions[i].live || !tableGet(&names, definitions[i].name, &unused)) continue;
+
+            definitions[i].live = true;
+            if (definitions[i].function != NULL) addUsedNames(definitions[i].function, &names, false);
+            changed = true;
+        }
+    } while (changed);
+
+    int dropped = 0;
+    for (int i = 0; i < count; i++) {
+        ArenaMark scriptMark = markArena();
+        Code code;
+        decode(&code, &scripts[i]->chunk);
+        for (int j = 0; j < code.count; j++) {
+            if (!isDefinition(&code, j)) continue;
+
+            Value unused;
+            int define = mergeable(&code, j);
+            Chunk* chunk = code.chunk;
+            if (tableGet(&names, AS_STRING(chunk->constants.values[code.instructions[define].operands[0]]), &unused)) continue;
+
+            // The function or value goes from the constants too, unless
+            // something else still loads it
+            int constant = code.instructions[j].operands[0];
+            removeInstruction(&code, j);
+            removeInstruction(&code, define);
+            if (!isConstantUsed(&code, constant)) chunk->constants.values[constant] = NULL_VAL;
+            dropped++;
+        }
+
+        if (code.changed) lower(&code);
+        releaseArena(scriptMark);
+    }
+
+    releaseArena(mark);
+    freeTable(&names);
+    return dropped;
+}
@@ -0,0 +1,23 @@
+#ifndef npp_optimizer_h
+#define npp_optimizer_h
+
+#include "chunk.h"
+
+// -O0 keeps the bytecode exactly as the compiler wrote it, -O1 removes dead
+// code and dead stores and merges common instruction pairs, -O2 also shares
+// repeated loads and expressions and inlines small functions.
+extern int optimizationLevel;
+
+#include "object.h"
+
+int optimizeFunction(ObjFunction* function);
+
+// Switches the jumps the compiler couldn't fit in two bytes to their long
+// form. jumps holds count pairs of the offset of a jump's distance operand
+// and the offset it jumps to. This runs even at -O0.
+void widenJumps(ObjFunction* function, int* jumps, int count);
+void addInlineCandidate(ObjFunction* function, bool isMethod);
+void clearInlineCandidates();
+int dropUnusedDefinitions(ObjFunction** scripts, int count);
+
+#endif
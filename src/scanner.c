@@ -4,18 +4,102 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
+// Whitespace, comments and the plain text of strings are skipped a vector
+// at a time with SSE2, or AVX2 when the build targets it. Only whole
+// vectors that end before scanner->end are loaded, and the usual one char
+// at a time code does the rest.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VECTOR_SIZE 32
+#define VECTOR_MASK 0xffffffffu
+typedef __m256i Vector;
+#define loadVector(bytes) _mm256_loadu_si256((const __m256i*)(bytes))
+#define matchMask(vector, c) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vector, _mm256_set1_epi8(c))))
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VECTOR_SIZE 16
+#define VECTOR_MASK 0xffffu
+typedef __m128i Vector;
+#define loadVector(bytes) _mm_loadu_si128((const __m128i*)(bytes))
+#define matchMask(vector, c) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(vector, _mm_set1_epi8(c))))
+#endif
+
+#ifdef VECTOR_SIZE
+#ifdef _MSC_VER
+#include <intrin.h>
+
+static inline int lowestBit(uint32_t mask) {
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+}
+
+static inline int countBits(uint32_t mask) {
+    return (int)__popcnt(mask);
+}
+#else
+static inline int lowestBit(uint32_t mask) {
+    return __builtin_ctz(mask);
+}
+
+static inline int countBits(uint32_t mask) {
+    return __builtin_popcount(mask);
+}
+#endif
 
-Scanner scanner;
+// Moves past the first count bytes of a vector with these newlines in it
+static inline void skipBytes(Scanner* scanner, uint32_t newlines, int count) {
+    if (count < VECTOR_SIZE) newlines &= (1u << count) - 1;
+    scanner->line += countBits(newlines);
+    scanner->current += count;
+}
 
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+// Spaces, tabs and newlines, like the indentation after a line
+static inline void skipBlanks(Scanner* scanner) {
+    while (scanner->end - scanner->current >= VECTOR_SIZE) {
+        Vector bytes = loadVector(scanner->current);
+        uint32_t newlines = matchMask(bytes, '\n');
+        uint32_t blanks = newlines | matchMask(bytes, ' ') | matchMask(bytes, '\t') | matchMask(bytes, '\r');
+        uint32_t others = ~blanks & VECTOR_MASK;
+        skipBytes(scanner, newlines, others == 0 ? VECTOR_SIZE : lowestBit(others));
+        if (others != 0) return;
+    }
+}
+
+// Up to the newline ending a // comment
+static inline void skipComment(Scanner* scanner) {
+    while (scanner->end - scanner->current >= VECTOR_SIZE) {
+        Vector bytes = loadVector(scanner->current);
+        uint32_t stops = matchMask(bytes, '\n') | matchMask(bytes, '\0');
+        if (stops != 0) {
+            scanner->current += lowestBit(stops);
+            return;
+        }
+        scanner->current += VECTOR_SIZE;
+    }
+}
+
+// Up to the closing quote or a $ that could start an interpolation
+static inline void skipStringText(Scanner* scanner) {
+    while (scanner->end - scanner->current >= VECTOR_SIZE) {
+        Vector bytes = loadVector(scanner->current);
+        uint32_t stops = matchMask(bytes, '"') | matchMask(bytes, '$') | matchMask(bytes, '\0');
+        skipBytes(scanner, matchMask(bytes, '\n'), stops == 0 ? VECTOR_SIZE : lowestBit(stops));
+        if (stops != 0) return;
+    }
+}
+#else
+static inline void skipBlanks(Scanner* scanner) {}
+static inline void skipComment(Scanner* scanner) {}
+static inline void skipStringText(Scanner* scanner) {}
+#endif
+
+void initScanner(Scanner* scanner, const char* source, int length) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + length;
+    scanner->line = 1;
+    scanner->interpolationDepth = 0;
 }
 
 static inline bool isAlpha(char c) {
@@ -26,65 +110,67 @@ static inline bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
 
-static inline bool isAtEnd() {
-    return *scanner.current == '\0';
+static inline bool isAtEnd(Scanner* scanner) {
+    return *scanner->current == '\0';
 }
 
-static inline char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static inline char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static inline char peek() {
-    return *scanner.current;
+static inline char peek(Scanner* scanner) {
+    return *scanner->current;
 }
 
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
 }
 
-static bool match(char expected) {
-    if (isAtEnd()) return false;
-    if (*scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
-static inline Token makeToken(TokenType type) {
+static inline Token makeToken(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static void skipWhitespace() {
+static void skipWhitespace(Scanner* scanner) {
     for (;;) {
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
                 break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
+                skipBlanks(scanner);
                 break;
             case '/':
-                if (peekNext() == '/') {
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                if (peekNext(scanner) == '/') {
+                    skipComment(scanner);
+                    while (peek(scanner) != '\n' && !isAtEnd(scanner)) advance(scanner);
                 } else {
                     return;
                 }
@@ -95,124 +181,158 @@ static void skipWhitespace() {
     }
 }
 
-static inline TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-    }
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
 
-    return TOKEN_IDENTIFIER;
-}
+// A perfect hash of the keywords: (first + 10 * second + length) & 63 is
+// different for each of them, found by trying small multipliers
+static const Keyword keywords[64] = {
+    [4] = {"null", 4, TOKEN_NULL},
+    [8] = {"this", 4, TOKEN_THIS},
+    [9] = {"throw", 5, TOKEN_THROW},
+    [10] = {"super", 5, TOKEN_SUPER},
+    [12] = {"while", 5, TOKEN_WHILE},
+    [25] = {"def", 3, TOKEN_FUN},
+    [29] = {"default", 7, TOKEN_DEFAULT},
+    [31] = {"switch", 6, TOKEN_SWITCH},
+    [32] = {"class", 5, TOKEN_CLASS},
+    [33] = {"else", 4, TOKEN_ELSE},
+    [37] = {"or", 2, TOKEN_OR},
+    [39] = {"if", 2, TOKEN_IF},
+    [42] = {"return", 6, TOKEN_RETURN},
+    [43] = {"try", 3, TOKEN_TRY},
+    [44] = {"true", 4, TOKEN_TRUE},
+    [48] = {"and", 3, TOKEN_AND},
+    [49] = {"case", 4, TOKEN_CASE},
+    [50] = {"catch", 5, TOKEN_CATCH},
+    [53] = {"false", 5, TOKEN_FALSE},
+    [56] = {"int", 3, TOKEN_VAR},
+    [62] = {"const", 5, TOKEN_CONST},
+    [63] = {"for", 3, TOKEN_FOR},
+};
 
 // Get keywords and stuff
-static inline TokenType identifierType() {
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                }
-            }
-            break;
-        case 'i':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'n': return checkKeyword(2, 1, "t", TOKEN_VAR);
-                    case 'f': return checkKeyword(2, 0, "", TOKEN_IF);
-                }
-            }
-            break;
-        case 'n': return checkKeyword(1, 3, "ull", TOKEN_NULL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-        case 'd': return checkKeyword(1, 2, "ef", TOKEN_FUN);
+static inline TokenType identifierType(Scanner* scanner) {
+    int length = (int)(scanner->current - scanner->start);
+    if (length < 2 || length > 7) return TOKEN_IDENTIFIER;
+
+    const unsigned char* start = (const unsigned char*)scanner->start;
+    const Keyword* keyword = &keywords[(start[0] + 10 * start[1] + length) & 63];
+    if (keyword->length == length && memcmp(scanner->start, keyword->name, length) == 0) {
+        return keyword->type;
     }
 
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+    while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number() {
-    while (isDigit(peek())) advance();
+static Token number(Scanner* scanner) {
+    while (isDigit(peek(scanner))) advance(scanner);
 
-    if (peek() == '.' && isDigit(peekNext())) {
-        advance();
-        while (isDigit(peek())) advance();
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+        advance(scanner);
+        while (isDigit(peek(scanner))) advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+static Token string(Scanner* scanner) {
+    skipStringText(scanner);
+    while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+        if (peek(scanner) == '$' && peekNext(scanner) == '{') {
+            if (scanner->interpolationDepth == MAX_INTERPOLATION) {
+                return errorToken(scanner, "Interpolation nested too deeply.");
+            }
+
+            advance(scanner);
+            advance(scanner);
+            scanner->braces[scanner->interpolationDepth++] = 0;
+            return makeToken(scanner, TOKEN_INTERPOLATION);
+        }
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
+        skipStringText(scanner);
     }
 
-    if (isAtEnd()) return errorToken("Unterminated string.");
-    advance();
-    return makeToken(TOKEN_STRING);
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
 // Tokens: Character edition
-Token scanToken() {
-    skipWhitespace();
-    scanner.start = scanner.current;
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
-    char c = advance();
-    if (isAlpha(c)) return identifier();
-    if (isDigit(c)) return number();
+Token scanToken(Scanner* scanner) {
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
+    char c = advance(scanner);
+    if (isAlpha(c)) return identifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     if (c == '(') {
-        return makeToken(TOKEN_LEFT_PAREN);
+        return makeToken(scanner, TOKEN_LEFT_PAREN);
     } else if (c == ')') {
-        return makeToken(TOKEN_RIGHT_PAREN);
+        return makeToken(scanner, TOKEN_RIGHT_PAREN);
     } else if (c == '{') {
-        return makeToken(TOKEN_LEFT_BRACE);
+        if (scanner->interpolationDepth > 0) scanner->braces[scanner->interpolationDepth - 1]++;
+        return makeToken(scanner, TOKEN_LEFT_BRACE);
     } else if (c == '}') {
-        return makeToken(TOKEN_RIGHT_BRACE);
+        if (scanner->interpolationDepth > 0 && scanner->braces[scanner->interpolationDepth - 1]-- == 0) {
+            // The end of an interpolated expression, so the string goes on
+            scanner->interpolationDepth--;
+            return string(scanner);
+        }
+        return makeToken(scanner, TOKEN_RIGHT_BRACE);
     } else if (c == ';') {
-        return makeToken(TOKEN_SEMICOLON);
+        return makeToken(scanner, TOKEN_SEMICOLON);
+    } else if (c == ':') {
+        return makeToken(scanner, TOKEN_COLON);
     } else if (c == ',') {
-        return makeToken(TOKEN_COMMA);
+        return makeToken(scanner, TOKEN_COMMA);
     } else if (c == '.') {
-        return makeToken(TOKEN_DOT);
+        return makeToken(scanner, TOKEN_DOT);
     } else if (c == '-') {
-        return makeToken(TOKEN_MINUS);
+        if (match(scanner, '-')) return makeToken(scanner, TOKEN_MINUS_MINUS);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_MINUS_EQUAL : TOKEN_MINUS);
     } else if (c == '+') {
-        return makeToken(TOKEN_PLUS);
+        if (match(scanner, '+')) return makeToken(scanner, TOKEN_PLUS_PLUS);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_PLUS_EQUAL : TOKEN_PLUS);
     } else if (c == '/') {
-        return makeToken(TOKEN_SLASH);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH);
     } else if (c == '*') {
-        return makeToken(TOKEN_STAR);
+        if (match(scanner, '*')) return makeToken(scanner, TOKEN_STAR_STAR);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_STAR_EQUAL : TOKEN_STAR);
+    } else if (c == '%') {
+        return makeToken(scanner, TOKEN_PERCENT);
+    } else if (c == '~' && match(scanner, '/')) {
+        // Integer division, since // starts a comment
+        return makeToken(scanner, TOKEN_TILDE_SLASH);
+    } else if (c == '&') {
+        return makeToken(scanner, TOKEN_AMPERSAND);
+    } else if (c == '|') {
+        return makeToken(scanner, TOKEN_PIPE);
+    } else if (c == '^') {
+        return makeToken(scanner, TOKEN_CARET);
     } else if (c == '!') {
-        return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     } else if (c == '=') {
-        return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     } else if (c == '<') {
-        return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        if (match(scanner, '<')) return makeToken(scanner, TOKEN_LESS_LESS);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     } else if (c == '>') {
-        return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        if (match(scanner, '>')) return makeToken(scanner, TOKEN_GREATER_GREATER);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     } else if (c == '"') {
-        return string();
+        return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -6,19 +6,26 @@ typedef enum {
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
-    TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+    TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR, TOKEN_COLON,
     
     TOKEN_BANG, TOKEN_BANG_EQUAL,
     TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
     TOKEN_GREATER, TOKEN_GREATER_EQUAL,
     TOKEN_LESS, TOKEN_LESS_EQUAL,
+    TOKEN_PLUS_EQUAL, TOKEN_MINUS_EQUAL,
+    TOKEN_STAR_EQUAL, TOKEN_SLASH_EQUAL,
+    TOKEN_PLUS_PLUS, TOKEN_MINUS_MINUS,
+    TOKEN_PERCENT, TOKEN_TILDE_SLASH, TOKEN_STAR_STAR,
+    TOKEN_AMPERSAND, TOKEN_PIPE, TOKEN_CARET,
+    TOKEN_LESS_LESS, TOKEN_GREATER_GREATER,
 
-    TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+    TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_INTERPOLATION, TOKEN_NUMBER,
 
     TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
     TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NULL, TOKEN_OR,
     TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS, TOKEN_TRUE,
-    TOKEN_VAR, TOKEN_WHILE,
+    TOKEN_VAR, TOKEN_WHILE, TOKEN_TRY, TOKEN_CATCH, TOKEN_THROW,
+    TOKEN_SWITCH, TOKEN_CASE, TOKEN_DEFAULT, TOKEN_CONST,
 
     TOKEN_ERROR, TOKEN_EOF
 } TokenType;
@@ -30,7 +37,23 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+#define MAX_INTERPOLATION 8
+
+// A string with ${ in it is scanned as a TOKEN_INTERPOLATION for each part
+// up to a ${ and a TOKEN_STRING for the rest, with the tokens of each
+// expression in between. braces counts the braces opened inside each
+// expression, so the scanner knows which } goes back to the string.
+// end is where the source stops, so whole vectors can be read up to it.
+typedef struct {
+    const char* start;
+    const char* current;
+    const char* end;
+    int line;
+    int braces[MAX_INTERPOLATION];
+    int interpolationDepth;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source, int length);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include <io.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+
+#include "source.h"
+
+// The rest of the last page of a view reads as zeros, which ends the source
+// like a '\0' would. A file that fills its last page exactly, or is empty,
+// has no room for one and is read instead.
+static bool mapSource(Source* source, HANDLE file) {
+    LARGE_INTEGER size;
+    SYSTEM_INFO system;
+    GetSystemInfo(&system);
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || size.QuadPart >= INT_MAX ||
+        size.QuadPart % system.dwPageSize == 0) {
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) return false;
+
+    // The view keeps the mapping open by itself
+    const char* view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == NULL) return false;
+
+    source->kind = SOURCE_MAPPED;
+    source->chars = view;
+    source->length = (int)size.QuadPart;
+    source->stream = NULL;
+    return true;
+}
+
+// Reads up to the end, since a pipe has no size to ask for
+static bool readSource(Source* source, FILE* file) {
+    size_t capacity = 4096;
+    size_t count = 0;
+    char* buffer = (char*)malloc(capacity);
+    while (buffer != NULL) {
+        count += fread(buffer + count, sizeof(char), capacity - count - 1, file);
+        if (count < capacity - 1 || count >= INT_MAX) break;
+
+        capacity *= 2;
+        char* grown = (char*)realloc(buffer, capacity);
+        if (grown == NULL) free(buffer);
+        buffer = grown;
+    }
+
+    if (buffer == NULL || ferror(file) || count >= INT_MAX) {
+        free(buffer);
+        return false;
+    }
+
+    buffer[count] = '\0';
+    source->kind = SOURCE_READ;
+    source->chars = buffer;
+    source->length = (int)count;
+    source->stream = NULL;
+    return true;
+}
+
+bool openSource(Source* source, const char* path, bool canStream) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+
+    HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+    if (GetFileType(handle) != FILE_TYPE_DISK) {
+        if (canStream) {
+            source->kind = SOURCE_STREAM;
+            source->chars = NULL;
+            source->length = 0;
+            source->stream = file;
+            return true;
+        }
+    } else if (mapSource(source, handle)) {
+        fclose(file);
+        return true;
+    }
+
+    bool read = readSource(source, file);
+    fclose(file);
+    return read;
+}
+
+void closeSource(Source* source) {
+    switch (source->kind) {
+        case SOURCE_MAPPED:
+            UnmapViewOfFile(source->chars);
+            break;
+        case SOURCE_READ:
+            free((char*)source->chars);
+            break;
+        case SOURCE_STREAM:
+            fclose(source->stream);
+            break;
+    }
+    source->chars = NULL;
+    source->stream = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef npp_source_h
+#define npp_source_h
+
+#include "common.h"
+
+typedef enum {
+    SOURCE_MAPPED,
+    SOURCE_READ,
+    SOURCE_STREAM
+} SourceKind;
+
+// The text of a script. Files on disk are mapped read-only and scanned in
+// place, so chars stays valid until closeSource(). A pipe can't be mapped:
+// with canStream it is left open as stream, to be read as it comes,
+// otherwise it is read into memory. chars always ends with a '\0'.
+typedef struct {
+    SourceKind kind;
+    const char* chars;
+    int length;
+    FILE* stream;
+} Source;
+
+bool openSource(Source* source, const char* path, bool canStream);
+void closeSource(Source* source);
+
+#endif
@@ -48,6 +48,16 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
+// Where the value for key is stored, or NULL if it isn't in the table. The
+// pointer is only good until the next key is added.
+Value* tableGetSlot(Table* table, ObjString* key) {
+    if (table->count == 0) return NULL;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return NULL;
+    return &entry->value;
+}
+
 static void adjustCapacity(Table* table, int capacity) {
     Entry* entries = ALLOCATE(Entry, capacity);
     for (int i = 0; i < capacity; i++) {
@@ -1,3 +1,5 @@
+#include <math.h>
+
 #include "memory.h"
 
 void initValueArray(ValueArray* array) {
@@ -41,6 +43,84 @@ void printValue(Value value) {
     }
 }
 
+// Doubles hold every integer up to 2^53 exactly, so integers in that range
+// can take the int64_t paths below
+#define SAFE_INTEGER 9007199254740992.0
+
+static inline bool isSafeInteger(double number) {
+    return number >= -SAFE_INTEGER && number <= SAFE_INTEGER && number == (double)(int64_t)number;
+}
+
+// The remainder takes the sign of the divisor, so x % n is always in [0, n)
+// for a positive n
+double numberModulo(double a, double b) {
+    if (isSafeInteger(a) && isSafeInteger(b) && b != 0) {
+        int64_t x = (int64_t)a;
+        int64_t y = (int64_t)b;
+        int64_t remainder = x % y;
+        if (remainder != 0 && (remainder < 0) != (y < 0)) remainder += y;
+        return (double)remainder;
+    }
+
+    double remainder = fmod(a, b);
+    if (remainder != 0 && (remainder < 0) != (b < 0)) remainder += b;
+    return remainder;
+}
+
+// Division rounded towards negative infinity, to match numberModulo
+double numberFloorDivide(double a, double b) {
+    if (isSafeInteger(a) && isSafeInteger(b) && b != 0) {
+        int64_t x = (int64_t)a;
+        int64_t y = (int64_t)b;
+        int64_t quotient = x / y;
+        if (x % y != 0 && (x < 0) != (y < 0)) quotient--;
+        return (double)quotient;
+    }
+
+    return floor(a / b);
+}
+
+double numberPower(double a, double b) {
+    if (b >= 0 && b <= 64 && b == (int)b) {
+        // Square and multiply, which is exact whenever the result is
+        int exponent = (int)b;
+        double result = 1;
+        while (exponent > 0) {
+            if (exponent & 1) result *= a;
+            a *= a;
+            exponent >>= 1;
+        }
+        return result;
+    }
+
+    return pow(a, b);
+}
+
+// Bitwise operators work on the 64-bit two's complement form of integers.
+// A negative shift count shifts the other way. Returns false if either
+// operand isn't an integer.
+bool numberBitwise(char op, double a, double b, double* result) {
+    if (a != trunc(a) || b != trunc(b) || fabs(a) >= 9223372036854775808.0 || fabs(b) >= 9223372036854775808.0) {
+        return false;
+    }
+
+    int64_t x = (int64_t)a;
+    int64_t y = (int64_t)b;
+    if ((op == '<' || op == '>') && y < 0) {
+        op = op == '<' ? '>' : '<';
+        y = -y;
+    }
+
+    switch (op) {
+        case '&': *result = (double)(x & y); break;
+        case '|': *result = (double)(x | y); break;
+        case '^': *result = (double)(x ^ y); break;
+        case '<': *result = y >= 64 ? 0 : (double)(int64_t)((uint64_t)x << y); break;
+        default: *result = (double)(y >= 64 ? (x < 0 ? -1 : 0) : x >> y); break;
+    }
+    return true;
+}
+
 bool valuesEqual(Value a, Value b) {
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
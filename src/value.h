@@ -15,6 +15,7 @@ typedef struct ObjString ObjString;
 #define TAG_NULL   1 
 #define TAG_FALSE 2 
 #define TAG_TRUE  3 
+#define TAG_SCALAR 4
 
 typedef uint64_t Value;
 
@@ -35,6 +36,9 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NULL_VAL        ((Value)(uint64_t)(QNAN | TAG_NULL))
+// Sits in the slot of an instance whose fields were scalar replaced. Scripts
+// can never see it.
+#define SCALAR_VAL      ((Value)(uint64_t)(QNAN | TAG_SCALAR))
 #define NUMBER_VAL(num) numToValue(num)
 
 #define OBJ_VAL(obj) \
@@ -52,6 +56,13 @@ static inline Value numToValue(double num) {
     return value;
 }
 
+// Spreads the bits of a value over the top of the word, for tables keyed by
+// the value itself rather than by string contents
+static inline uint32_t hashValue(Value value) {
+    value *= 0x9e3779b97f4a7c15;
+    return (uint32_t)(value >> 32);
+}
+
 typedef struct {
     int capacity;
     int count;
@@ -59,6 +70,10 @@ typedef struct {
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
+double numberModulo(double a, double b);
+double numberFloorDivide(double a, double b);
+double numberPower(double a, double b);
+bool numberBitwise(char op, double a, double b, double* result);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +8,7 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "module.h"
 #include "vm.h"
 #include "native.h"
 
@@ -17,37 +19,86 @@ static void resetStack() {
     vm.openUpvalues = NULL;
 }
 
-// Error thing
-void runtimeError(const char* format, ...) {
+static void reportFrame(ObjFunction* function, int line) {
+    printf("\033[0;34m");
+    fprintf(stderr, "[line %d]", line);
+    printf("\033[0;33m");
+    printf(" in ");
+    if (function->name == NULL) {
+        fprintf(stderr, "script\n");
+    } else {
+        fprintf(stderr, "%s()\n", function->name->chars);
+    }
+    printf("\033[0m");
+}
+
+static void reportError() {
     printf("\033[0;31m");
     printf("Runtime Error:\n");
     printf("\033[0m");
 
     printf("\033[0;36m");
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
+    if (IS_STRING(vm.exception)) {
+        fputs(AS_CSTRING(vm.exception), stderr);
+    } else {
+        printValue(vm.exception);
+    }
     fputs("\n", stderr);
     printf("\033[0;34m");
 
     for (int i = vm.frameCount - 1; i >= 0; i--) {
-        printf("\033[0;34m");
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d]", function->chunk.lines[instruction]);
-        printf("\033[0;33m");
-        printf(" in ");
-        if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+        LineStart* start = findLine(&function->chunk, (int)instruction);
+
+        // An inlined body runs in its caller's frame, but still gets its
+        // own line in the trace
+        if (start != NULL && start->inlined != -1) {
+            reportFrame(AS_FUNCTION(function->chunk.constants.values[start->inlined]), start->inlinedLine);
         }
-        printf("\033[0m");
+        reportFrame(function, start == NULL ? 0 : start->line);
     }
+}
 
-    resetStack();
+static void raiseError(const char* format, va_list args) {
+    char message[1024];
+    int length = vsnprintf(message, sizeof(message), format, args);
+    if (length < 0) length = 0;
+    if (length >= (int)sizeof(message)) length = (int)sizeof(message) - 1;
+
+    vm.exception = OBJ_VAL(copyString(message, length));
+    vm.hasException = true;
+}
+
+// Error thing
+// * Nothing is printed here, the error is thrown once control gets back to
+// * run() and only reported if no try block catches it
+void runtimeError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    raiseError(format, args);
+    va_end(args);
+}
+
+// * Natives throw with "return throwError(...);" so they stop right away
+Value throwError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    raiseError(format, args);
+    va_end(args);
+    return NULL_VAL;
+}
+
+Value throwValue(Value value) {
+    vm.exception = value;
+    vm.hasException = true;
+    return NULL_VAL;
+}
+
+// For allocations that would take the heap over vm.maxHeap
+Value throwOutOfMemory() {
+    return throwValue(OBJ_VAL(vm.outOfMemoryString));
 }
 
 static Value peek(int distance) {
@@ -72,7 +123,9 @@ static bool isFalsey(Value value) {
 // * Native functions are functions that are defined in the code natively
 void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
+    ObjNative* native = newNative(function);
+    native->name = AS_STRING(vm.stack[0]);
+    push(OBJ_VAL(native));
     tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
     pop();
     pop();
@@ -81,8 +134,14 @@ void defineNative(const char* name, NativeFn function) {
 void initVM() {
     resetStack();
     vm.objects = NULL;
+    vm.exception = NULL_VAL;
+    vm.hasException = false;
+    vm.instructionBudget = 0;
+    vm.budget = INT64_MAX;
+    atomic_init(&vm.interrupted, 0);
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.maxHeap = 0;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
@@ -91,24 +150,72 @@ void initVM() {
     initTable(&vm.globals);
     initTable(&vm.strings);
     vm.initString = NULL;
+    vm.outOfMemoryString = NULL;
     vm.initString = copyString("init", 4);
+    vm.outOfMemoryString = copyString("Out of memory.", 14);
 
     defineNatives();
 }
 
 void freeVM() {
+    freeModules();
     freeTable(&vm.globals);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.outOfMemoryString = NULL;
     freeObjects();
 }
 
+// The budget is counted in bytecode bytes and only charged when a loop jumps
+// back or a function is called, so straight-line code never pays for it.
+// A budget of 0 means no limit.
+void setInstructionBudget(int64_t budget) {
+    vm.instructionBudget = budget;
+}
+
+// * Safe to call from another thread (a watchdog timer for example)
+void interruptVM() {
+    atomic_fetch_or_explicit(&vm.interrupted, INTERRUPT_WATCHDOG, memory_order_relaxed);
+}
+
+// An allocation went over vm.maxHeap even after a full collection. The error
+// is thrown here, once the instruction that made it is done and the stack is
+// in a consistent state.
+static bool raiseOutOfMemory() {
+    int pending = atomic_load_explicit(&vm.interrupted, memory_order_relaxed);
+    if (vm.budget < 0 || (pending & INTERRUPT_WATCHDOG)) return false;
+
+    atomic_fetch_and_explicit(&vm.interrupted, ~INTERRUPT_OUT_OF_MEMORY, memory_order_relaxed);
+    throwOutOfMemory();
+    return true;
+}
+
+static InterpretResult abortRun() {
+    printf("\033[0;31m");
+    printf("Execution Stopped:\n");
+    printf("\033[0;36m");
+    if (atomic_exchange_explicit(&vm.interrupted, 0, memory_order_relaxed) & INTERRUPT_WATCHDOG) {
+        fprintf(stderr, "Interrupted by watchdog.\n");
+    } else {
+        fprintf(stderr, "Instruction budget of %lld exceeded.\n", (long long)vm.instructionBudget);
+    }
+    printf("\033[0m");
+
+    resetStack();
+    return INTERPRET_TIMEOUT;
+}
+
 bool call_(ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
+    if (closure->function->lazy != NULL && !compileLazy(closure->function)) {
+        runtimeError("Could not compile \"%s\".", closure->function->name->chars);
+        return false;
+    }
+
     if (vm.frameCount >= FRAMES_MAX) {
         runtimeError("Stack overflow.");
         return false;
@@ -147,6 +254,7 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
                 Value result = native(argCount, vm.stackTop - argCount);
+                if (vm.hasException) return false;
                 vm.stackTop -= argCount + 1;
                 push(result);
                 return true;
@@ -240,12 +348,16 @@ static void defineMethod(ObjString* name) {
     pop();
 }
 
-static void concatenate() {
+static bool concatenate() {
     ObjString* b = AS_STRING(peek(0));
     ObjString* a = AS_STRING(peek(1));
 
     int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
+    char* chars = TRY_ALLOCATE(char, length + 1);
+    if (chars == NULL) {
+        throwOutOfMemory();
+        return false;
+    }
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
@@ -254,6 +366,104 @@ static void concatenate() {
     pop();
     pop();
     push(OBJ_VAL(result));
+    return true;
+}
+
+// Replaces the count values on top of the stack with the string they make
+static bool buildStringOnStack(int count) {
+    for (Value* part = vm.stackTop - count; part < vm.stackTop; part++) {
+        if (!IS_STRING(*part) && !IS_NUMBER(*part)) {
+            runtimeError("Only numbers and strings can be interpolated.");
+            return false;
+        }
+    }
+
+    ObjString* result = buildString(vm.stackTop - count, count);
+    if (result == NULL) {
+        throwOutOfMemory();
+        return false;
+    }
+
+    vm.stackTop -= count;
+    push(OBJ_VAL(result));
+    return true;
+}
+
+// Applies the arithmetic operator op to the two values on top of the stack,
+// leaving the result in their place
+static bool arithmetic(char op) {
+    if (op == '+' && IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        return concatenate();
+    }
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+        runtimeError(op == '+' ? "Operands must be two numbers or two strings." : "Operands must be numbers.");
+        return false;
+    }
+
+    double b = AS_NUMBER(pop());
+    double a = AS_NUMBER(pop());
+    switch (op) {
+        case '+': push(NUMBER_VAL(a + b)); break;
+        case '-': push(NUMBER_VAL(a - b)); break;
+        case '*': push(NUMBER_VAL(a * b)); break;
+        default: push(NUMBER_VAL(a / b)); break;
+    }
+    return true;
+}
+
+// Combines *target with the value on top of the stack and stores the result
+// back, leaving it on the stack unless isSet is SET_AND_POP
+static bool compound(Value* target, char op, uint8_t isSet) {
+    Value operand = pop();
+    Value old = *target;
+    push(old);
+    push(operand);
+    if (!arithmetic(op)) return false;
+
+    *target = peek(0);
+    if (isSet == SET_AND_POP) {
+        pop();
+    } else if (isSet == POSTFIX) {
+        vm.stackTop[-1] = old;
+    }
+    return true;
+}
+
+// Walk the frames from the innermost outwards looking for a try block that
+// covers the instruction being executed. Only called once an error is thrown.
+static bool catchException() {
+    for (int i = vm.frameCount - 1; i >= 0; i--) {
+        CallFrame* frame = &vm.frames[i];
+        Chunk* chunk = &frame->closure->function->chunk;
+        int offset = (int)(frame->ip - chunk->code - 1);
+
+        for (int j = 0; j < chunk->handlerCount; j++) {
+            Handler* handler = &chunk->handlers[j];
+            if (offset < handler->start || offset >= handler->end) continue;
+
+            Value exception = vm.exception;
+            vm.exception = NULL_VAL;
+            vm.hasException = false;
+
+            for (int k = i + 1; k < vm.frameCount; k++) {
+                ObjFunction* function = vm.frames[k].closure->function;
+                if (function->name == NULL) forgetModule(function);
+            }
+
+            closeUpvalues(frame->slots + handler->stackDepth);
+            vm.frameCount = i + 1;
+            vm.stackTop = frame->slots + handler->stackDepth;
+            push(exception);
+            frame->ip = chunk->code + handler->target;
+            return true;
+        }
+    }
+
+    reportError();
+    vm.exception = NULL_VAL;
+    vm.hasException = false;
+    resetStack();
+    return false;
 }
 
 // * Finally, we can run the code
@@ -264,28 +474,80 @@ static InterpretResult run() {
     #define READ_SHORT() \
         (frame->ip += 2, \
         (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    #define READ_LONG() \
+        (frame->ip += 3, \
+        (int)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+    #define READ_INDEX() (instruction & OP_LONG ? READ_LONG() : READ_BYTE())
+    #define READ_OFFSET() (instruction & OP_LONG ? READ_LONG() : READ_SHORT())
     #define READ_CONSTANT() \
-        (frame->closure->function->chunk.constants.values[READ_BYTE()])
+        (frame->closure->function->chunk.constants.values[READ_INDEX()])
     #define READ_STRING() AS_STRING(READ_CONSTANT())
+    #define THROW() goto unwind
+    #define SAFEPOINT(cost) \
+        do { \
+            vm.budget -= (cost); \
+            if (vm.budget < 0 || atomic_load_explicit(&vm.interrupted, memory_order_relaxed)) { \
+                if (raiseOutOfMemory()) THROW(); \
+                return abortRun(); \
+            } \
+        } while (false)
+    // Instructions that allocate check right away, so a heap over
+    // vm.maxHeap throws before anything else gets allocated
+    #define CHECK_HEAP() \
+        do { \
+            if ((atomic_load_explicit(&vm.interrupted, memory_order_relaxed) & INTERRUPT_OUT_OF_MEMORY) && \
+                raiseOutOfMemory()) THROW(); \
+        } while (false)
+    #define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+    #define FOR_LIMIT(mode, operand) \
+        ((mode) & FOR_CONSTANT_LIMIT ? frame->closure->function->chunk.constants.values[operand] : frame->slots[operand])
+    #define FOR_CONTINUES(counter, limit, mode) \
+        ((mode) & FOR_INCLUSIVE ? !(AS_NUMBER(counter) > AS_NUMBER(limit)) : AS_NUMBER(counter) < AS_NUMBER(limit))
     #define BINARY_OP(valueType, op) \
         do { \
             if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
                 runtimeError("Operands must be numbers."); \
-                return INTERPRET_RUNTIME_ERROR; \
+                THROW(); \
             } \
             double b = AS_NUMBER(pop()); \
             double a = AS_NUMBER(pop()); \
             push(valueType(a op b)); \
         } while (false)
 
+    #define NUMBER_OP(function) \
+        do { \
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+                runtimeError("Operands must be numbers."); \
+                THROW(); \
+            } \
+            double b = AS_NUMBER(pop()); \
+            double a = AS_NUMBER(pop()); \
+            push(NUMBER_VAL(function(a, b))); \
+        } while (false)
+
+    #define BITWISE_OP(op) \
+        do { \
+            double result; \
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)) || \
+                !numberBitwise(op, AS_NUMBER(peek(1)), AS_NUMBER(peek(0)), &result)) { \
+                runtimeError("Operands must be integers."); \
+                THROW(); \
+            } \
+            pop(); \
+            pop(); \
+            push(NUMBER_VAL(result)); \
+        } while (false)
+
     for (;;) {
         register uint8_t instruction = READ_BYTE();
         switch (instruction) {
+            case OP_CONSTANT_LONG:
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
                 push(constant);
                 break;
             }
+            case OP_BOOL | OP_LONG:
             case OP_BOOL: {
                 ObjString* name = READ_STRING();
                 char* cstr = name->chars;
@@ -301,17 +563,22 @@ static InterpretResult run() {
             case OP_POP: 
                 pop(); 
                 break;
+            case OP_DUP:
+                push(peek(0));
+                break;
             case OP_LOCAL: {
                 uint8_t slot = READ_BYTE();
                 uint8_t isSet = READ_BYTE();
 
                 if (isSet) {
                     *(frame->slots + slot) = peek(0);
+                    if (isSet == SET_AND_POP) pop();
                 } else {
                     push(*(frame->slots + slot));
                 }
                 break;
             }
+            case OP_GLOBAL | OP_LONG:
             case OP_GLOBAL: {
                 ObjString* name = READ_STRING();
                 uint8_t isSet = READ_BYTE();
@@ -320,13 +587,14 @@ static InterpretResult run() {
                     if (tableSet(&vm.globals, name, peek(0))) {
                         tableDelete(&vm.globals, name);
                         runtimeError("Undefined variable '%s'.", name->chars);
-                        return INTERPRET_RUNTIME_ERROR;
+                        THROW();
                     }
+                    if (isSet == SET_AND_POP) pop();
                 } else {
                     Value value;
                     if (!tableGet(&vm.globals, name, &value)) {
                         runtimeError("Undefined variable '%s'.", name->chars);
-                        return INTERPRET_RUNTIME_ERROR;
+                        THROW();
                     }
                     push(value);
                 }
@@ -338,21 +606,25 @@ static InterpretResult run() {
 
                 if (isSet) {
                     *frame->closure->upvalues[slot]->location = peek(0);
+                    if (isSet == SET_AND_POP) pop();
                 } else {
                     push(*frame->closure->upvalues[slot]->location);
                 }
                 break;
             }
+            case OP_DEFINE_GLOBAL | OP_LONG:
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING();
                 tableSet(&vm.globals, name, peek(0));
                 pop();
+                CHECK_HEAP();
                 break;
             }
+            case OP_GET_PROPERTY | OP_LONG:
             case OP_GET_PROPERTY: {
                 if (!IS_INSTANCE(peek(0))) {
                     runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(0));
@@ -366,14 +638,16 @@ static InterpretResult run() {
                 }
 
                 if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
+                CHECK_HEAP();
                 break;
             }
+            case OP_SET_PROPERTY | OP_LONG:
             case OP_SET_PROPERTY: {
                 if (!IS_INSTANCE(peek(1))) {
                     runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(1));
@@ -381,30 +655,34 @@ static InterpretResult run() {
                 Value value = pop();
                 pop();
                 push(value);
+                CHECK_HEAP();
                 break;
             }
+            case OP_GET_SUPER | OP_LONG:
             case OP_GET_SUPER: {
                 ObjString* name = READ_STRING();
                 ObjClass* superclass = AS_CLASS(pop());
                 
                 if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
+                CHECK_HEAP();
                 break;
             }
+            case OP_BINARY | OP_LONG:
             case OP_BINARY: {
                 ObjString* name = READ_STRING();
                 char* cstr = name->chars;
                 if (strcmp(cstr, "+") == 0) {
                     if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                        concatenate();
+                        if (!concatenate()) THROW();
                     } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                         double b = AS_NUMBER(pop());
                         double a = AS_NUMBER(pop());
                         push(NUMBER_VAL(a + b));
                     } else {
                         runtimeError("Operands must be two numbers or two strings.");
-                        return INTERPRET_RUNTIME_ERROR;
+                        THROW();
                     }
                 } else if (strcmp(cstr, "-") == 0) {
                     BINARY_OP(NUMBER_VAL, -);
@@ -413,8 +691,10 @@ static InterpretResult run() {
                 } else if (strcmp(cstr, "/") == 0) {
                     BINARY_OP(NUMBER_VAL, /);
                 }
+                CHECK_HEAP();
                 break;
             }
+            case OP_COMPARE | OP_LONG:
             case OP_COMPARE:
                 ObjString* name = READ_STRING();
                 char* cstr = name->chars;
@@ -430,52 +710,204 @@ static InterpretResult run() {
                     BINARY_OP(BOOL_VAL, <);
                 }
                 break;
+            case OP_COMPARE_NOT | OP_LONG:
+            case OP_COMPARE_NOT: {
+                ObjString* name = READ_STRING();
+                char* cstr = name->chars;
+                if (strcmp(cstr, "!") == 0) {
+                    push(BOOL_VAL(!isFalsey(pop())));
+                } else if (strcmp(cstr, "=") == 0) {
+                    Value b = pop();
+                    Value a = pop();
+                    push(BOOL_VAL(!valuesEqual(a, b)));
+                } else if (strcmp(cstr, ">") == 0) {
+                    BINARY_OP(NOT_BOOL_VAL, >);
+                } else if (strcmp(cstr, "<") == 0) {
+                    BINARY_OP(NOT_BOOL_VAL, <);
+                }
+                break;
+            }
             case OP_UNARY:
                 if (!IS_NUMBER(peek(0))) {
                     runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
                 break;
+            case OP_BUILD_STRING:
+                if (!buildStringOnStack(READ_BYTE())) THROW();
+                CHECK_HEAP();
+                break;
+            case OP_MODULO:
+                NUMBER_OP(numberModulo);
+                break;
+            case OP_FLOOR_DIVIDE:
+                NUMBER_OP(numberFloorDivide);
+                break;
+            case OP_POWER:
+                NUMBER_OP(numberPower);
+                break;
+            case OP_BIT_AND:
+                BITWISE_OP('&');
+                break;
+            case OP_BIT_OR:
+                BITWISE_OP('|');
+                break;
+            case OP_BIT_XOR:
+                BITWISE_OP('^');
+                break;
+            case OP_SHIFT_LEFT:
+                BITWISE_OP('<');
+                break;
+            case OP_SHIFT_RIGHT:
+                BITWISE_OP('>');
+                break;
+            case OP_JUMP | OP_LONG:
             case OP_JUMP: {
-                int16_t offset = (int16_t)READ_SHORT();
+                int offset = READ_OFFSET();
                 frame->ip += offset;
                 break;
             }
+            case OP_JUMP_IF_FALSE | OP_LONG:
             case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
+                int offset = READ_OFFSET();
                 if (isFalsey(peek(0))) frame->ip += offset;
                 break;
             }
+            case OP_JUMP_IF_TRUE | OP_LONG:
+            case OP_JUMP_IF_TRUE: {
+                int offset = READ_OFFSET();
+                if (!isFalsey(peek(0))) frame->ip += offset;
+                break;
+            }
+            case OP_POP_JUMP_IF_FALSE | OP_LONG:
+            case OP_POP_JUMP_IF_FALSE: {
+                int offset = READ_OFFSET();
+                if (isFalsey(pop())) frame->ip += offset;
+                break;
+            }
+            case OP_LOOP | OP_LONG:
+            case OP_LOOP: {
+                int offset = READ_OFFSET();
+                SAFEPOINT(offset);
+                frame->ip -= offset;
+                break;
+            }
+            case OP_JUMP_TABLE | OP_LONG:
+            case OP_JUMP_TABLE: {
+                ObjJumpTable* table = AS_JUMP_TABLE(READ_CONSTANT());
+                Value value = pop();
+                int index = table->count;
+                if (IS_NUMBER(value)) {
+                    double slot = AS_NUMBER(value) - table->low;
+                    if (slot >= 0 && slot < table->count && slot == (int)slot) index = (int)slot;
+                }
+                frame->ip = frame->closure->function->chunk.code + table->targets[index];
+                break;
+            }
+            case OP_JUMP_HASH | OP_LONG:
+            case OP_JUMP_HASH: {
+                ObjJumpTable* table = AS_JUMP_TABLE(READ_CONSTANT());
+                Value value = pop();
+                if (IS_NUMBER(value) && AS_NUMBER(value) == 0) value = NUMBER_VAL(0);
+
+                // Empty slots go to the default, so the probe can stop at
+                // whichever comes first
+                uint32_t index = hashValue(value) & (table->count - 1);
+                while (table->keys[index] != value && table->keys[index] != NULL_VAL) {
+                    index = (index + 1) & (table->count - 1);
+                }
+                frame->ip = frame->closure->function->chunk.code + table->targets[index];
+                break;
+            }
+            case OP_FOR_LOOP | OP_LONG:
+            case OP_FOR_LOOP: {
+                Value* counter = frame->slots + READ_BYTE();
+                uint8_t mode = READ_BYTE();
+                Value limit = FOR_LIMIT(mode, READ_INDEX());
+                int offset = READ_OFFSET();
+
+                if (!IS_NUMBER(*counter) || !IS_NUMBER(limit)) {
+                    runtimeError("Operands must be numbers.");
+                    THROW();
+                }
+                if (!FOR_CONTINUES(*counter, limit, mode)) frame->ip += offset;
+                break;
+            }
+            case OP_FOR_STEP | OP_LONG:
+            case OP_FOR_STEP: {
+                Value* counter = frame->slots + READ_BYTE();
+                uint8_t mode = READ_BYTE();
+                int limitOperand = READ_INDEX();
+                Value step = READ_CONSTANT();
+                int offset = READ_OFFSET();
+
+                if (!IS_NUMBER(*counter)) {
+                    runtimeError("Operands must be two numbers or two strings.");
+                    THROW();
+                }
+                *counter = NUMBER_VAL(AS_NUMBER(*counter) + AS_NUMBER(step));
+
+                Value limit = FOR_LIMIT(mode, limitOperand);
+                if (!IS_NUMBER(limit)) {
+                    runtimeError("Operands must be numbers.");
+                    THROW();
+                }
+                if (FOR_CONTINUES(*counter, limit, mode)) {
+                    SAFEPOINT(offset);
+                    frame->ip -= offset;
+                }
+                break;
+            }
             case OP_CALL: {
                 int argCount = READ_BYTE();
+                SAFEPOINT(1);
                 if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                CHECK_HEAP();
                 break;
             }
+            case OP_INVOKE | OP_LONG:
             case OP_INVOKE: {
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
+                SAFEPOINT(1);
                 if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                CHECK_HEAP();
                 break;
             }
+            case OP_SUPER_INVOKE | OP_LONG:
             case OP_SUPER_INVOKE: {
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
+                SAFEPOINT(1);
                 ObjClass* superclass = AS_CLASS(pop());
                 if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                CHECK_HEAP();
                 break;
             }
+            case OP_CLOSURE | OP_LONG:
             case OP_CLOSURE: {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+
+                // A closure that captures nothing, of a function whose
+                // closures are never compared, can't be told apart from
+                // another one, so it is only made once
+                if (function->upvalueCount == 0 && function->shareClosure) {
+                    if (function->closure == NULL) function->closure = newClosure(function);
+                    push(OBJ_VAL(function->closure));
+                    CHECK_HEAP();
+                    break;
+                }
+
                 ObjClosure* closure = newClosure(function);
                 push(OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalueCount; i++) {
@@ -487,6 +919,7 @@ static InterpretResult run() {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
+                CHECK_HEAP();
                 break;
             }
             case OP_CLOSE_UPVALUE:
@@ -507,46 +940,294 @@ static InterpretResult run() {
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
+            case OP_CLASS | OP_LONG:
             case OP_CLASS:
                 push(OBJ_VAL(newClass(READ_STRING())));
+                CHECK_HEAP();
                 break;
             case OP_INHERIT: {
                 Value superclass = peek(1);
                 if (!IS_CLASS(superclass)) {
                     runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    THROW();
                 }
 
                 ObjClass* subclass = AS_CLASS(peek(0));
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
                 pop();
+                CHECK_HEAP();
                 break;
             }
+            case OP_METHOD | OP_LONG:
             case OP_METHOD:
                 defineMethod(READ_STRING());
+                CHECK_HEAP();
+                break;
+            case OP_THROW:
+                throwValue(pop());
+                THROW();
+            case OP_INLINE_GUARD | OP_LONG:
+            case OP_INLINE_GUARD: {
+                int argCount = READ_BYTE();
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                int offset = READ_OFFSET();
+                SAFEPOINT(1);
+
+                Value callee = peek(argCount);
+                if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function) break;
+
+                frame->ip += offset;
+                if (!callValue(callee, argCount)) {
+                    THROW();
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                CHECK_HEAP();
+                break;
+            }
+            case OP_INLINE_INVOKE_GUARD | OP_LONG:
+            case OP_INLINE_INVOKE_GUARD: {
+                ObjString* method = READ_STRING();
+                int argCount = READ_BYTE();
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                int offset = READ_OFFSET();
+                SAFEPOINT(1);
+
+                Value receiver = peek(argCount);
+                if (IS_INSTANCE(receiver)) {
+                    ObjInstance* instance = AS_INSTANCE(receiver);
+                    Value value;
+                    if (!tableGet(&instance->fields, method, &value) &&
+                        tableGet(&instance->klass->methods, method, &value) &&
+                        AS_CLOSURE(value)->function == function) break;
+                }
+
+                frame->ip += offset;
+                if (!invoke(method, argCount)) {
+                    THROW();
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                CHECK_HEAP();
+                break;
+            }
+            case OP_SCALAR_NEW | OP_LONG:
+            case OP_SCALAR_NEW: {
+                int argCount = READ_BYTE();
+                int extraCount = READ_BYTE();
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                int offset = READ_OFFSET();
+
+                Value callee = peek(argCount + extraCount);
+                Value initializer;
+                if (IS_CLASS(callee) && tableGet(&AS_CLASS(callee)->methods, vm.initString, &initializer) &&
+                    AS_CLOSURE(initializer)->function == function) {
+                    vm.stackTop[-1 - argCount - extraCount] = SCALAR_VAL;
+                    frame->ip += offset;
+                }
+                break;
+            }
+            case OP_SCALAR_GET | OP_LONG:
+            case OP_SCALAR_GET: {
+                uint8_t slot = READ_BYTE();
+                uint8_t field = READ_BYTE();
+                ObjString* name = READ_STRING();
+                Value object = frame->slots[slot];
+                if (object == SCALAR_VAL) {
+                    push(frame->slots[field]);
+                    break;
+                }
+
+                if (!IS_INSTANCE(object)) {
+                    runtimeError("Only instances have properties.");
+                    THROW();
+                }
+
+                ObjInstance* instance = AS_INSTANCE(object);
+                Value value;
+                if (tableGet(&instance->fields, name, &value)) {
+                    push(value);
+                    break;
+                }
+
+                push(object);
+                if (!bindMethod(instance->klass, name)) {
+                    THROW();
+                }
+                CHECK_HEAP();
+                break;
+            }
+            case OP_SCALAR_SET | OP_LONG:
+            case OP_SCALAR_SET: {
+                uint8_t slot = READ_BYTE();
+                uint8_t field = READ_BYTE();
+                ObjString* name = READ_STRING();
+                Value object = frame->slots[slot];
+                if (object == SCALAR_VAL) {
+                    frame->slots[field] = peek(0);
+                    break;
+                }
+
+                if (!IS_INSTANCE(object)) {
+                    runtimeError("Only instances have fields.");
+                    THROW();
+                }
+
+                tableSet(&AS_INSTANCE(object)->fields, name, peek(0));
+                CHECK_HEAP();
+                break;
+            }
+            case OP_ADD_LOCAL_CONST | OP_LONG:
+            case OP_ADD_LOCAL_CONST:
+            case OP_ADD_UPVALUE_CONST | OP_LONG:
+            case OP_ADD_UPVALUE_CONST: {
+                uint8_t slot = READ_BYTE();
+                Value constant = READ_CONSTANT();
+                uint8_t isSet = READ_BYTE();
+                Value* target = (instruction & ~OP_LONG) == OP_ADD_LOCAL_CONST ?
+                    frame->slots + slot : frame->closure->upvalues[slot]->location;
+
+                if (IS_NUMBER(*target) && IS_NUMBER(constant)) {
+                    Value old = *target;
+                    *target = NUMBER_VAL(AS_NUMBER(old) + AS_NUMBER(constant));
+                    if (isSet == POSTFIX) {
+                        push(old);
+                    } else if (isSet != SET_AND_POP) {
+                        push(*target);
+                    }
+                    break;
+                }
+
+                // The compiler only negates constants for x -= c, so a
+                // negative one subtracts and fails with the - message
+                bool subtract = IS_NUMBER(constant) && signbit(AS_NUMBER(constant));
+                push(subtract ? NUMBER_VAL(-AS_NUMBER(constant)) : constant);
+                if (!compound(target, subtract ? '-' : '+', isSet)) {
+                    THROW();
+                }
+                CHECK_HEAP();
+                break;
+            }
+            case OP_COMPOUND_LOCAL | OP_LONG:
+            case OP_COMPOUND_LOCAL: {
+                uint8_t slot = READ_BYTE();
+                char op = READ_STRING()->chars[0];
+                if (!compound(frame->slots + slot, op, READ_BYTE())) {
+                    THROW();
+                }
+                CHECK_HEAP();
                 break;
+            }
+            case OP_COMPOUND_UPVALUE | OP_LONG:
+            case OP_COMPOUND_UPVALUE: {
+                uint8_t slot = READ_BYTE();
+                char op = READ_STRING()->chars[0];
+                if (!compound(frame->closure->upvalues[slot]->location, op, READ_BYTE())) {
+                    THROW();
+                }
+                CHECK_HEAP();
+                break;
+            }
+            case OP_COMPOUND_GLOBAL | OP_LONG:
+            case OP_COMPOUND_GLOBAL: {
+                ObjString* name = READ_STRING();
+                char op = READ_STRING()->chars[0];
+                Value* global = tableGetSlot(&vm.globals, name);
+                if (global == NULL) {
+                    runtimeError("Undefined variable '%s'.", name->chars);
+                    THROW();
+                }
+                if (!compound(global, op, READ_BYTE())) {
+                    THROW();
+                }
+                CHECK_HEAP();
+                break;
+            }
+            case OP_COMPOUND_PROPERTY | OP_LONG:
+            case OP_COMPOUND_PROPERTY: {
+                ObjString* name = READ_STRING();
+                char op = READ_STRING()->chars[0];
+                uint8_t isSet = READ_BYTE();
+                if (!IS_INSTANCE(peek(1))) {
+                    runtimeError("Only instances have properties.");
+                    THROW();
+                }
+
+                Value* field = tableGetSlot(&AS_INSTANCE(peek(1))->fields, name);
+                if (field == NULL) {
+                    runtimeError("Undefined property '%s'.", name->chars);
+                    THROW();
+                }
+                if (!compound(field, op, isSet == POSTFIX ? POSTFIX : 1)) {
+                    THROW();
+                }
+
+                Value value = pop();
+                pop();
+                if (isSet != SET_AND_POP) push(value);
+                CHECK_HEAP();
+                break;
+            }
+            case OP_INLINE_EXIT: {
+                Value result = pop();
+                vm.stackTop = frame->slots + READ_BYTE();
+                push(result);
+                break;
+            }
+            case OP_NATIVE_GUARD | OP_LONG:
+            case OP_NATIVE_GUARD: {
+                ObjString* name = READ_STRING();
+                Value result = READ_CONSTANT();
+                int offset = READ_OFFSET();
+
+                // The call was worked out at compile time. If the global
+                // still holds that native, skip the call and use its result.
+                Value callee;
+                if (tableGet(&vm.globals, name, &callee) && IS_NATIVE(callee) &&
+                    ((ObjNative*)AS_OBJ(callee))->name == name) {
+                    push(result);
+                    frame->ip += offset;
+                }
+                break;
+            }
         }
+        continue;
+
+    unwind:
+        if (!catchException()) return INTERPRET_RUNTIME_ERROR;
+        frame = &vm.frames[vm.frameCount - 1];
     }
 
     #undef READ_BYTE
     #undef READ_SHORT
+    #undef READ_LONG
+    #undef READ_INDEX
+    #undef READ_OFFSET
     #undef READ_CONSTANT
     #undef READ_STRING
+    #undef THROW
+    #undef CHECK_HEAP
+    #undef SAFEPOINT
     #undef BINARY_OP
+    #undef NUMBER_OP
+    #undef BITWISE_OP
+    #undef NOT_BOOL_VAL
+    #undef FOR_LIMIT
+    #undef FOR_CONTINUES
 }
 
 // Interpret the code
 InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(function);
+}
 
+// Runs a script that is already compiled
+InterpretResult interpretFunction(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     call_(closure, 0);
-    InterpretResult result = run();
-    printf("\033[0m");
-
-    return result;
+    vm.budget = vm.instructionBudget > 0 ? vm.instructionBudget : INT64_MAX;
+    return run();
 }
\ No newline at end of file
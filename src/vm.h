@@ -1,6 +1,8 @@
 #ifndef npp_vm_h
 #define npp_vm_h
 
+#include <stdatomic.h>
+
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -13,6 +15,10 @@
 #define JIT_THRESHOLD 1000000
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+// Reasons for stopping at the next safepoint, kept in vm.interrupted
+#define INTERRUPT_WATCHDOG      1
+#define INTERRUPT_OUT_OF_MEMORY 2
+
 typedef struct {
     ObjClosure* closure;
     uint8_t* ip;
@@ -27,9 +33,16 @@ typedef struct {
     Table globals;
     Table strings;
     ObjString* initString;
+    ObjString* outOfMemoryString;
     ObjUpvalue* openUpvalues;
+    Value exception;
+    bool hasException;
+    int64_t instructionBudget;
+    int64_t budget;
+    atomic_int interrupted;
     size_t bytesAllocated;
     size_t nextGC;
+    size_t maxHeap;
     Obj* objects;
     int grayCount;
     int grayCapacity;
@@ -39,18 +52,25 @@ typedef struct {
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_TIMEOUT
 } InterpretResult;
 
 extern VM vm;
 
 void init(const char** args, int argsCountt);
 void runtimeError(const char* format, ...);
+Value throwError(const char* format, ...);
+Value throwValue(Value value);
+Value throwOutOfMemory();
 void defineNative(const char* name, NativeFn function);
 void initVM();
 void freeVM();
 bool call_(ObjClosure* closure, int argCount);
+void setInstructionBudget(int64_t budget);
+void interruptVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
 void push(Value value);
 Value pop();
 